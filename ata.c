@@ -10,6 +10,7 @@
 #include <proto/alib.h>
 #include <proto/expansion.h>
 #include <exec/errors.h>
+#include <exec/execbase.h>
 #include <stdbool.h>
 
 #include "debug.h"
@@ -21,9 +22,10 @@
 #include "blockcopy.h"
 #include "wait.h"
 
-static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features);
-static BYTE write_taskfile_lba48(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features);
-static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features);
+static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features);
+static BYTE write_taskfile_lba48(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features);
+static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features);
+static void ata_set_policy(struct IDEUnit *unit, UWORD *identify);
 
 /**
  * ata_status_reg_delay
@@ -52,6 +54,7 @@ static void __attribute__((always_inline)) ata_status_reg_delay(struct IDEUnit *
  * 
 */
 static void ata_save_error(struct IDEUnit *unit) {
+    ata_tf_invalidate(unit->itask);
     unit->last_error[0] = unit->drive->error_features[0];
     unit->last_error[1] = unit->drive->lbaHigh[0];
     unit->last_error[2] = unit->drive->lbaMid[0];
@@ -73,75 +76,268 @@ static bool __attribute__((always_inline)) ata_check_error(struct IDEUnit *unit)
 }
 
 /**
- * ata_wait_drq
+ * ata_sleep
+ * 
+ * Sleep between status polls
+ * When interrupts are enabled for the channel the task is also woken by the drive raising INTRQ,
+ * otherwise this is a plain timer wait.
  * 
- * Poll DRQ in the status register until set or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
- * @param fast More aggressive polling, 1000 tries before timer wait vs 100
+ * @param micros Maximum time to sleep for
 */
-static bool ata_wait_drq(struct IDEUnit *unit, ULONG tries, bool fast) {
-    struct timerequest *tr = unit->itask->tr;
-    Trace("wait_drq enter\n");
+void ata_sleep(struct IDEUnit *unit, ULONG micros) {
+    struct IDETask *itask = unit->itask;
+    struct timerequest *tr = itask->tr;
+
+    if (!itask->irqEnabled) {
+        wait_us(tr,micros);
+        ata_burst_start(itask);
+        return;
+    }
+
+    SetSignal(0,itask->irqMask);
+    itask->irqWait = true;
+
+    tr->tr_node.io_Command = TR_ADDREQUEST;
+    tr->tr_time.tv_sec     = 0;
+    tr->tr_time.tv_micro   = micros;
+    SendIO((struct IORequest *)tr);
+
+    Wait(itask->irqMask | (1 << itask->timermp->mp_SigBit));
+
+    itask->irqWait = false;
+
+    if (!CheckIO((struct IORequest *)tr)) AbortIO((struct IORequest *)tr);
+    WaitIO((struct IORequest *)tr);
+
+    ata_burst_start(itask);
+}
+
+/**
+ * ata_burst_start
+ * 
+ * Start timing a CPU burst, called whenever the task has given up the CPU
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+void ata_burst_start(struct IDETask *itask) {
+    if (itask->burstBudget == 0) return;
+
+    if (itask->eclockPerMs) {
+        itask->burstStart = read_eclock(itask->tr);
+    } else {
+        itask->burstBlocks = 0;
+    }
+}
+
+/**
+ * ata_set_burst
+ * 
+ * Set how long a PIO transfer may keep the CPU before it yields to other ready tasks
+ * 
+ * @param itask Pointer to an IDETask struct
+ * @param micros Budget in microseconds, 0 to never yield
+*/
+void ata_set_burst(struct IDETask *itask, ULONG micros) {
+    itask->burstUs = micros;
+
+    if (micros == 0) {
+        itask->burstBudget = 0;
+    } else if (itask->eclockPerMs) {
+        itask->burstBudget = ((micros / 1000) * itask->eclockPerMs) + (((micros % 1000) * itask->eclockPerMs) / 1000) + 1;
+    } else {
+        itask->burstBudget = (micros / BURST_US_PER_BLOCK) + 1;
+    }
+
+    ata_burst_start(itask);
+}
+
+/**
+ * ata_burst
+ * 
+ * Called after each DRQ block of a transfer, once the burst budget is used up and other tasks are ready
+ * the task sleeps for BURST_YIELD_US so that they can run.
+ * 
+ * @param itask Pointer to an IDETask struct
+ * @param blocks Blocks transferred since the last call
+*/
+static inline void ata_burst(struct IDETask *itask, ULONG blocks) {
+    if (itask->burstBudget == 0) return;
+
+    if (itask->eclockPerMs) {
+        if ((read_eclock(itask->tr) - itask->burstStart) < itask->burstBudget) return;
+    } else {
+        if ((itask->burstBlocks += blocks) < itask->burstBudget) return;
+    }
+
+    if (SysBase->TaskReady.lh_Head->ln_Succ != NULL) {
+        wait_us(itask->tr,BURST_YIELD_US);
+        itask->yields++;
+    }
+
+    ata_burst_start(itask);
+}
+
+/**
+ * ata_calibrate_wait
+ * 
+ * Time status register reads on the channel so that waits can spin for a time budget rather than a loop count
+ * Without the EClock (Kickstart 1.x) a conservative default is used and wait times are estimated
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+void ata_calibrate_wait(struct IDETask *itask) {
+    ULONG start, ticks;
+
+    itask->pollsPerMs  = WAIT_POLLS_PER_MS;
+    itask->eclockPerMs = 0;
+
+    if (SysBase->SoftVer < 36) return;
+
+    struct Device *TimerBase = itask->tr->tr_node.io_Device;
+    struct EClockVal ev;
+
+    itask->eclockPerMs = ReadEClock(&ev) / 1000;
+
+    start = read_eclock(itask->tr);
+    for (int i=0; i < WAIT_CALIBRATE_POLLS; i++) {
+        (void)*itask->statusReg;
+    }
+    ticks = read_eclock(itask->tr) - start;
+
+    if (ticks > 0) {
+        itask->pollsPerMs = (WAIT_CALIBRATE_POLLS * itask->eclockPerMs) / ticks;
+    }
+    if (itask->pollsPerMs == 0) itask->pollsPerMs = 1;
+
+    Info("INIT: %ld status polls per ms\n",itask->pollsPerMs);
+}
+
+/**
+ * ata_wait_status
+ * 
+ * Wait for the status register to match, shared by all of the ATA and ATAPI waits
+ * 
+ * The status is polled continuously for spin_us, after that the delay between polls starts at WAIT_BACKOFF_MIN_US
+ * and doubles on each miss up to WAIT_BACKOFF_MAX_US.
+ * Delays under 1ms are timed with the EClock, longer ones sleep on timer.device (or INTRQ, see ata_sleep).
+ * The time taken is recorded in unit->waitLast and unit->waitMax
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param mask Status bits to test
+ * @param match Value the masked status must equal
+ * @param abort Give up early if any of these status bits are set
+ * @param spin_us How long to poll before backing off
+ * @param timeout_ms Timeout
+ * @returns true if the status matched before the timeout
+*/
+bool ata_wait_status(struct IDEUnit *unit, UBYTE mask, UBYTE match, UBYTE abort, ULONG spin_us, ULONG timeout_ms) {
+    struct IDETask *itask = unit->itask;
+    volatile UBYTE *status_reg = unit->drive->status_command;
+    ULONG per_ms  = itask->eclockPerMs;
+    ULONG timeout = timeout_ms * 1000;
+    ULONG delay   = WAIT_BACKOFF_MIN_US;
+    ULONG elapsed = 0;
+    ULONG start   = 0;
+    bool  matched = false;
     UBYTE status;
 
-    int loops = (fast) ? 1000 : 100;
+    status = *status_reg;
+    if ((status & mask) == match) {
+        unit->waitLast = 0;
+        return true;
+    }
 
-    for (int i=0; i < tries; i++) {
-        // Try a bunch of times before imposing the speed penalty of the timer...
-        for (int j=0; j<loops; j++) {
-            status = *unit->drive->status_command;
-            if ((status & ata_flag_drq) != 0) return true;
-            if (status & (ata_flag_error | ata_flag_df)) return false;
+    if (per_ms) start = read_eclock(itask->tr);
+
+    for (ULONG i = (spin_us * itask->pollsPerMs) / 1000; i > 0; i--) {
+        status = *status_reg;
+        if ((status & mask) == match) {
+            matched = true;
+            goto done;
         }
-        wait_us(tr,ATA_DRQ_WAIT_LOOP_US);
+        if (status & abort) goto done;
     }
-    Trace("wait_drq timeout\n");
-    return false;
+    elapsed = spin_us;
+
+    while (elapsed < timeout) {
+        if (delay < 1000 && per_ms && !itask->irqEnabled) {
+            wait_eclock_us(itask->tr,delay,per_ms);
+        } else {
+            ata_sleep(unit,delay);
+        }
+
+        if (per_ms) {
+            elapsed = eclock_to_us(read_eclock(itask->tr) - start, per_ms);
+        } else {
+            elapsed += delay;
+        }
+
+        status = *status_reg;
+        if ((status & mask) == match) {
+            matched = true;
+            break;
+        }
+        if (status & abort) break;
+
+        if (delay < WAIT_BACKOFF_MAX_US) {
+            delay <<= 1;
+            if (delay > WAIT_BACKOFF_MAX_US) delay = WAIT_BACKOFF_MAX_US;
+        }
+    }
+
+done:
+    if (per_ms) elapsed = eclock_to_us(read_eclock(itask->tr) - start, per_ms);
+
+    unit->waitLast = elapsed;
+    if (elapsed > unit->waitMax) unit->waitMax = elapsed;
+
+    if (!matched) Trace("wait_status timeout, status: %02lx\n",status);
+
+    return matched;
+}
+
+/**
+ * ata_wait_drq
+ * 
+ * Wait for DRQ in the status register until set or timeout
+ * @param unit Pointer to an IDEUnit struct
+ * @param tries Timeout in ms
+ * @param fast More aggressive polling, spin for WAIT_SPIN_FAST_US before backing off
+*/
+static bool ata_wait_drq(struct IDEUnit *unit, ULONG tries, bool fast) {
+    return ata_wait_status(unit,
+                           ata_flag_drq,
+                           ata_flag_drq,
+                           (ata_flag_error | ata_flag_df),
+                           (fast) ? WAIT_SPIN_FAST_US : WAIT_SPIN_US,
+                           tries);
 }
 
 /**
  * ata_wait_not_busy
  * 
- * Poll BSY in the status register until clear or timeout
+ * Wait for BSY in the status register to clear or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool ata_wait_not_busy(struct IDEUnit *unit, ULONG tries) {
-    struct timerequest *tr = unit->itask->tr;
-
     ata_status_reg_delay(unit);
 
-    for (int i=0; i < tries; i++) {
-        // Try a bunch of times before imposing the speed penalty of the timer...
-        for (int j=0; j<100; j++) {
-            if ((*unit->drive->status_command & ata_flag_busy) == 0) return true;
-        }
-        wait_us(tr,ATA_BSY_WAIT_LOOP_US);
-    }
-    return false;
+    return ata_wait_status(unit,ata_flag_busy,0,0,WAIT_SPIN_US,tries);
 }
 
 /**
  * ata_wait_ready
  * 
- * Poll RDY in the status register until set or timeout
+ * Wait for RDY in the status register until set or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool ata_wait_ready(struct IDEUnit *unit, ULONG tries) {
-    struct timerequest *tr = unit->itask->tr;
-
     ata_status_reg_delay(unit);
 
-    for (int i=0; i < tries; i++) {
-        // Try a bunch of times before imposing the speed penalty of the timer...
-        for (int j=0; j<1000; j++) {
-            if ((*unit->drive->status_command & (ata_flag_ready | ata_flag_busy)) == ata_flag_ready) return true;
-        }
-        wait_us(tr,ATA_RDY_WAIT_LOOP_US);
-    }
-    return false;
+    return ata_wait_status(unit,(ata_flag_ready | ata_flag_busy),ata_flag_ready,0,WAIT_SPIN_FAST_US,tries);
 }
 
 /**
@@ -163,15 +359,20 @@ bool ata_select(struct IDEUnit *unit, UBYTE select, bool wait)
     if (!unit->lba) select &= ~(0x40);
 
     if (*shadowDevHead == select) {
+        unit->itask->tfSkipped++;
         return false;
     }
 
-    if ((*shadowDevHead & 0xF0) != (select & 0xF0)) changed = true;
+    if ((*shadowDevHead & 0xF0) != (select & 0xF0)) {
+        changed = true;
+        ata_tf_invalidate(unit->itask);
+    }
 
     // Wait for BSY to clear before changing drive unless there's no drive selected
     if (*shadowDevHead != 0 && changed) ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT); 
 
     *unit->drive->devHead = select;
+    unit->itask->tfWrites++;
 
     if (changed && wait) {
         wait_us(unit->itask->tr,5); // Could possibly be replaced with call to ata_status_reg_delay
@@ -199,12 +400,12 @@ bool ata_identify(struct IDEUnit *unit, UWORD *buffer)
 
     if (!ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT)) return false;
  
-    *unit->drive->sectorCount    = 0;
-    *unit->drive->lbaLow         = 0;
-    *unit->drive->lbaMid         = 0;
-    *unit->drive->lbaHigh        = 0;
-    *unit->drive->error_features = 0;
-    *unit->drive->status_command = ATA_CMD_IDENTIFY;
+    ata_tf_write(unit,tf_sectorCount,0);
+    ata_tf_write(unit,tf_lbaLow,0);
+    ata_tf_write(unit,tf_lbaMid,0);
+    ata_tf_write(unit,tf_lbaHigh,0);
+    ata_tf_write(unit,tf_features,0);
+    ata_tf_command(unit,ATA_CMD_IDENTIFY);
 
     if (ata_check_error(unit) || !ata_wait_drq(unit,500,false)) {
         Warn("ATA: IDENTIFY Status: Error\n");
@@ -226,28 +427,171 @@ bool ata_identify(struct IDEUnit *unit, UWORD *buffer)
     return true;
 }
 
+/**
+ * ata_set_xfer
+ * 
+ * Select the transfer routines used by the unit
+ * If the CPU can't run the requested method fall back to the next best one
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param method Transfer method
+*/
 void ata_set_xfer(struct IDEUnit *unit, enum xfer method) {
+    struct ExecBase *SysBase = unit->SysBase;
+
+    if (method == longword_move16 && !(SysBase->AttnFlags & (AFF_68040 | AFF_68060))) {
+        method = longword_move;
+    }
+
+    if (method == longword_move020 && !(SysBase->AttnFlags & AFF_68020)) {
+        method = longword_movem;
+    }
+
     switch (method) {
         default:
         case longword_movem:
             unit->read_fast       = &ata_read_long_movem;
-            unit->read_unaligned  = &ata_read_unaligned_long;
+            unit->read_unaligned  = &ata_read_unaligned_merge;
             unit->write_fast      = &ata_write_long_movem;
-            unit->write_unaligned = &ata_write_unaligned_long;
+            unit->write_unaligned = &ata_write_unaligned_merge;
 
             unit->xferMethod = longword_movem;
             break;
         case longword_move:
             unit->read_fast       = &ata_read_long_move;
-            unit->read_unaligned  = &ata_read_unaligned_long;
+            unit->read_unaligned  = &ata_read_unaligned_merge;
             unit->write_fast      = &ata_write_long_move;
-            unit->write_unaligned = &ata_write_unaligned_long;
+            unit->write_unaligned = &ata_write_unaligned_merge;
 
             unit->xferMethod = longword_move;
             break;
+        case longword_move020:
+            unit->read_fast       = &ata_read_long_move020;
+            unit->read_unaligned  = &ata_read_unaligned_merge;
+            unit->write_fast      = &ata_write_long_move020;
+            unit->write_unaligned = &ata_write_unaligned_merge;
+
+            unit->xferMethod = longword_move020;
+            break;
+        case longword_move16:
+            // Reading the source buffer already bursts on these CPUs so writes use plain move.l
+            unit->read_fast       = &ata_read_long_move16;
+            unit->read_unaligned  = &ata_read_unaligned_merge;
+            unit->write_fast      = &ata_write_long_move;
+            unit->write_unaligned = &ata_write_unaligned_merge;
+
+            unit->xferMethod = longword_move16;
+            break;
     }
 }
 
+/**
+ * ata_bench_read
+ * 
+ * Time a read routine by reading the IDENTIFY data through it XFER_BENCH_PASSES times
+ * Only the copy out of the data port is timed, the command overhead is the same for every routine
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param command IDENTIFY command to issue, ATA or ATAPI
+ * @param xfer Read routine to time
+ * @param dest Pointer to a 512 byte buffer
+ * @returns Speed in KB/s, 0 on error
+*/
+static ULONG ata_bench_read(struct IDEUnit *unit, UBYTE command, void (*xfer)(void *, void *, ULONG), void *dest) {
+    struct Device *TimerBase = unit->itask->tr->tr_node.io_Device;
+    struct EClockVal start, end;
+    ULONG ticks = 0;
+    ULONG freq  = 0;
+
+    for (int i=0; i < XFER_BENCH_PASSES; i++) {
+        if (!ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT)) return 0;
+
+        ata_tf_write(unit,tf_sectorCount,0);
+        ata_tf_write(unit,tf_lbaLow,0);
+        ata_tf_write(unit,tf_lbaMid,0);
+        ata_tf_write(unit,tf_lbaHigh,0);
+        ata_tf_write(unit,tf_features,0);
+        ata_tf_command(unit,command);
+
+        if (ata_check_error(unit) || !ata_wait_drq(unit,500,false)) return 0;
+
+        freq = ReadEClock(&start);
+        xfer((void *)unit->drive->data,dest,1);
+        ReadEClock(&end);
+
+        ticks += (end.ev_lo - start.ev_lo);
+    }
+
+    if (ticks == 0) ticks = 1;
+
+    // KB/s = (passes * 512 / 1024) * EClock frequency / ticks
+    return ((XFER_BENCH_PASSES / 2) * freq) / ticks;
+}
+
+/**
+ * ata_bench_xfer
+ * 
+ * Time each transfer method the CPU can run and keep the fastest
+ * The measured speeds are kept in the unit so they can be shown by lidetool, 0 for a method that wasn't measured
+ * 
+ * MOVE16 only runs between buffers in CPU-local fast RAM, see move16_ok.
+ * If the bench buffer or this task's stack isn't there the method is not measured as it would really be timing move.l
+ * It is still chosen over move in that case since it falls back to move.l for buffers it can't line-transfer.
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param command IDENTIFY command to issue, ATA or ATAPI
+*/
+static void ata_bench_xfer(struct IDEUnit *unit, UBYTE command) {
+    struct ExecBase *SysBase = unit->SysBase;
+    enum xfer fastest = unit->xferMethod;
+    ULONG best = 0;
+    bool skipped16 = false;
+    UBYTE *buf;
+
+    // Accelerator RAM is normally the highest priority fast memory, that is where MOVE16 can be measured
+    if ((buf = AllocMem(512+16,MEMF_FAST)) == NULL && (buf = AllocMem(512+16,MEMF_ANY)) == NULL) return;
+
+    UBYTE *dest = (UBYTE *)(((ULONG)buf + 15) & ~15); // Line-aligned so that the MOVE16 path is measured
+
+    UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0; // Select drive
+
+    ata_select(unit,drvSel,false);
+
+    for (enum xfer method = 0; method < xfer_methods; method++) {
+        unit->xferSpeed[method] = 0;
+
+        ata_set_xfer(unit,method);
+        if (unit->xferMethod != method) continue; // Not supported by this CPU
+
+        // The line buffer of ata_read_long_move16 is on this task's stack
+        if (method == longword_move16 && (!move16_ok(dest,512) || !move16_ok((void *)((ULONG)&best & ~15),16))) {
+            Info("INIT: Transfer method %ld: not measured, no CPU-local fast RAM\n",method);
+            skipped16 = true;
+            continue;
+        }
+
+        if ((unit->xferSpeed[method] = ata_bench_read(unit,command,unit->read_fast,dest)) == 0) continue;
+
+        Info("INIT: Transfer method %ld: %ld KB/s\n",method,unit->xferSpeed[method]);
+
+        if (unit->xferSpeed[method] > best) {
+            best    = unit->xferSpeed[method];
+            fastest = method;
+        }
+    }
+
+    if (skipped16 && (fastest == longword_move || best == 0)) fastest = longword_move16;
+
+    ata_set_xfer(unit,fastest);
+
+    // The odd-aligned routines are shared by all methods so only need timing once
+    unit->xferSpeedUnaligned = ata_bench_read(unit,command,unit->read_unaligned,dest + 1);
+    Info("INIT: Unaligned transfer: %ld KB/s\n",unit->xferSpeedUnaligned);
+
+    ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT);
+    FreeMem(buf,512+16);
+}
+
 /**
  * ata_init_unit
  * 
@@ -262,6 +606,7 @@ bool ata_init_unit(struct IDEUnit *unit) {
     unit->blockSize       = 0;
     unit->present         = false;
     unit->mediumPresent   = false;
+    unit->maxTransfer     = MAX_TRANSFER_SECTORS;
 
     ata_set_xfer(unit,unit->xferMethod);
 
@@ -273,6 +618,7 @@ bool ata_init_unit(struct IDEUnit *unit) {
     unit->drive = (void *)unit->cd->cd_BoardAddr + offset; // Pointer to drive base
 
     *unit->shadowDevHead = *unit->drive->devHead = (unit->primary) ? 0xE0 : 0xF0; // Select drive
+    ata_tf_invalidate(unit->itask);
 
     for (int i=0; i<(8*NEXT_REG); i+=NEXT_REG) {
         // Check if the bus is floating (D7/6 pulled-up with resistors)
@@ -312,6 +658,10 @@ bool ata_init_unit(struct IDEUnit *unit) {
             unit->multipleCount = 1;
         }
 
+        unit->writeCacheSupported = (buf[ata_identify_command_set] & ata_command_set_wcache) != 0;
+        unit->writeCache          = (buf[ata_identify_enabled] & ata_command_set_wcache) != 0;
+        unit->flushExt            = (buf[ata_identify_features] & ata_feature_flush_ext) != 0;
+
         // Support LBA-48 but only up to 2TB
         if ((buf[ata_identify_features] & ata_feature_lba48) && unit->logicalSectors >= 0xFFFFFFF) {
             if (buf[ata_identify_lba48_sectors + 2] > 0 ||
@@ -325,6 +675,7 @@ bool ata_init_unit(struct IDEUnit *unit) {
             unit->logicalSectors = (buf[ata_identify_lba48_sectors + 1] << 16 | 
                                     buf[ata_identify_lba48_sectors]);
             unit->write_taskfile = &write_taskfile_lba48;
+            unit->maxTransfer    = MAX_TRANSFER_SECTORS_LBA48;
  
         } else if (unit->lba == true) {
             // LBA-28 up to 127GB
@@ -359,12 +710,26 @@ bool ata_init_unit(struct IDEUnit *unit) {
         while ((unit->blockSize >> unit->blockShift) > 1) {
             unit->blockShift++;
         }
+
+        if (unit->writeCacheSupported && unit->writeCache != ATA_WRITE_CACHE) {
+            ata_set_write_cache(unit,ATA_WRITE_CACHE);
+        }
+        Info("INIT: Write cache %s\n",(unit->writeCache) ? "enabled" : "disabled");
+
+        ata_set_policy(unit,buf);
+
+        unit->nonRotational = (buf[ata_identify_rotation] == ata_rotation_none);
+        if (unit->nonRotational) Info("INIT: Non-rotating media\n");
     } else if (atapi_check_signature(unit)) { // Check for ATAPI Signature
         if (atapi_identify(unit,buf) && (buf[0] & 0xC000) == 0x8000) {
             Info("INIT: ATAPI Drive found!\n");
 
                 unit->deviceType      = (buf[0] >> 8) & 0x1F;
                 unit->atapi           = true;
+                unit->gesn            = true; // Cleared by atapi_check_media if it turns out not to be supported
+                unit->overlapSupported = (buf[ata_identify_capabilities] & ata_capability_overlap) != 0;
+                unit->overlap          = (ATAPI_OVERLAP && unit->overlapSupported);
+                if (unit->overlapSupported) Info("INIT: Overlapped commands supported\n");
         } else {
 ident_failed:
             Warn("INIT: IDENTIFY failed\n");
@@ -381,6 +746,12 @@ ident_failed:
     }
 
     Info("INIT: Blockshift: %ld\n",unit->blockShift);
+
+    // ReadEClock needs timer.device V36+, otherwise keep the default chosen for the CPU
+    if (unit->SysBase->SoftVer >= 36) {
+        ata_bench_xfer(unit,(unit->atapi) ? ATAPI_CMD_IDENTIFY : ATA_CMD_IDENTIFY);
+    }
+
     unit->present = true;
 
     Info("INIT: LBAs %ld Blocksize: %ld\n",unit->logicalSectors,unit->blockSize);
@@ -405,12 +776,12 @@ bool ata_set_multiple(struct IDEUnit *unit, BYTE multiple) {
     if (!ata_wait_ready(unit,ATA_RDY_WAIT_COUNT))
             return HFERR_SelTimeout;
 
-    *unit->drive->sectorCount    = multiple;
-    *unit->drive->lbaLow         = 0;
-    *unit->drive->lbaMid         = 0;
-    *unit->drive->lbaHigh        = 0;
-    *unit->drive->error_features = 0;
-    *unit->drive->status_command = ATA_CMD_SET_MULTIPLE;
+    ata_tf_write(unit,tf_sectorCount,multiple);
+    ata_tf_write(unit,tf_lbaLow,0);
+    ata_tf_write(unit,tf_lbaMid,0);
+    ata_tf_write(unit,tf_lbaHigh,0);
+    ata_tf_write(unit,tf_features,0);
+    ata_tf_command(unit,ATA_CMD_SET_MULTIPLE);
 
     if (!ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT))
         return IOERR_UNITBUSY;
@@ -453,7 +824,7 @@ BYTE ata_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
         command = (unit->xferMultiple) ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ;
     } 
 
-    void (*ata_xfer)(void *source, void *destination);
+    void (*ata_xfer)(void *source, void *destination, ULONG count);
 
     /* If the buffer is not word-aligned we need to use a slower routine */
     if (((ULONG)buffer) & 0x01) {
@@ -462,6 +833,11 @@ BYTE ata_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
         ata_xfer = unit->read_fast;
     }
 
+    ULONG block_count; // Sectors to transfer in the current DRQ block
+    ULONG multiple_count = unit->multipleCount;
+    UWORD block_shift    = unit->blockShift;
+    ULONG max_transfer   = unit->maxTransfer;
+
     UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0;
 
     ata_select(unit,drvSel,true);
@@ -472,15 +848,15 @@ BYTE ata_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
     }
 
     /**
-     * Transfer up-to MAX_TRANSFER_SECTORS per ATA command invocation
+     * Transfer up-to unit->maxTransfer sectors per ATA command invocation
      * 
      * count:          Number of sectors to transfer for this io request
      * txn_count:      Number of sectors to transfer to/from the drive in one ATA command transaction
      * multiple_count: Max number of sectors that can be transferred before polling DRQ
      */
     while (count > 0) {
-        if (count >= MAX_TRANSFER_SECTORS) { // Transfer 256 Sectors at a time
-            txn_count = MAX_TRANSFER_SECTORS;
+        if (count >= max_transfer) {
+            txn_count = max_transfer;
         } else {
             txn_count = count;               // Get any remainders
         }
@@ -502,11 +878,11 @@ BYTE ata_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
             }
 
             /* Transfer up to (multiple_count) sectors before polling DRQ again */
-            for (int i = 0; i < unit->multipleCount && txn_count; i++) {
-                ata_xfer((void *)unit->drive->data,buffer);
-                txn_count--;
-                buffer += unit->blockSize;
-            }
+            block_count = (txn_count > multiple_count) ? multiple_count : txn_count;
+            ata_xfer((void *)unit->drive->data,buffer,block_count);
+            txn_count -= block_count;
+            buffer += (block_count << block_shift);
+            ata_burst(unit->itask,block_count);
         }
 
     }
@@ -540,7 +916,7 @@ BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
         command = (unit->xferMultiple) ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE;
     }
 
-    void (*ata_xfer)(void *source, void *destination);
+    void (*ata_xfer)(void *source, void *destination, ULONG count);
 
     /* If the buffer is not word-aligned we need to use a slower routine */
     if ((ULONG)buffer & 0x01) {
@@ -549,6 +925,11 @@ BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
         ata_xfer = unit->write_fast;
     }
 
+    ULONG block_count; // Sectors to transfer in the current DRQ block
+    ULONG multiple_count = unit->multipleCount;
+    UWORD block_shift    = unit->blockShift;
+    ULONG max_transfer   = unit->maxTransfer;
+
     UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0;
 
     ata_select(unit,drvSel,true);
@@ -559,15 +940,15 @@ BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
     }
 
     /**
-     * Transfer up-to MAX_TRANSFER_SECTORS per ATA command invocation
+     * Transfer up-to unit->maxTransfer sectors per ATA command invocation
      * 
      * count:          Number of sectors to transfer for this io request
      * txn_count:      Number of sectors to transfer to/from the drive in one ATA command transaction
      * multiple_count: Max number of sectors that can be transferred before polling DRQ
      */
     while (count > 0) {
-        if (count >= MAX_TRANSFER_SECTORS) { // Transfer 256 Sectors at a time
-            txn_count = MAX_TRANSFER_SECTORS;
+        if (count >= max_transfer) {
+            txn_count = max_transfer;
         } else {
             txn_count = count;               // Get any remainders
         }
@@ -589,11 +970,11 @@ BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
             }
 
             /* Transfer up to (multiple_count) sectors before polling DRQ again */
-            for (int i = 0; i < unit->multipleCount && txn_count; i++) {
-                ata_xfer(buffer,(void *)unit->drive->data);
-                txn_count--;
-                buffer += unit->blockSize;
-            }
+            block_count = (txn_count > multiple_count) ? multiple_count : txn_count;
+            ata_xfer(buffer,(void *)unit->drive->data,block_count);
+            txn_count -= block_count;
+            buffer += (block_count << block_shift);
+            ata_burst(unit->itask,block_count);
         }
 
     }
@@ -602,39 +983,124 @@ BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
 }
 
 /**
- * ata_read_unaligned_long
+ * ata_transfer_extents
  * 
- * Read data to an unaligned buffer
- * @param source Pointer to the drive data port
- * @param destination Pointer to the data buffer
+ * Transfer a run of consecutive blocks to or from several buffers
+ * The run is split into commands only at unit->maxTransfer like ata_read/ata_write,
+ * a DRQ block that straddles two buffers is simply split between them.
+ * 
+ * @param ext Array of extents, one per buffer
+ * @param extents Number of extents
+ * @param lba LBA Address of the first block
+ * @param direction READ or WRITE
+ * @param done Set to the number of blocks transferred before any error
+ * @param unit Pointer to the unit structure
+ * @returns error
 */
-void ata_read_unaligned_long(void *source, void *destination) {
-    ULONG readLong;
-    UBYTE *dest = (UBYTE *)destination;
-
-    for (int i=0; i<(512/4); i++) {          // Read (512 / 4) Long words from drive
-        readLong = *(ULONG *)source;
-        dest[0] = ((readLong >> 24) & 0xFF); // Write it out in 4 bytes
-        dest[1] = ((readLong >> 16) & 0xFF);
-        dest[2] = ((readLong >> 8) & 0xFF);
-        dest[3] = (readLong & 0xFF);
-        dest += 4;                           // Increment dest pointer by 4 bytes
+BYTE ata_transfer_extents(struct ATAExtent *ext, ULONG extents, ULONG lba, enum xfer_dir direction, ULONG *done, struct IDEUnit *unit) {
+    Trace("ata_transfer_extents enter\n");
+
+    UBYTE error = 0;
+    ULONG count = 0;
+    ULONG txn_count;  // Amount of sectors to transfer in the current READ/WRITE command
+    ULONG drq_block;  // Sectors in the current DRQ block
+    ULONG drq_count;  // Sectors left in the current DRQ block
+    ULONG ext_count;  // Sectors left in the current extent
+    UBYTE *buffer;
+    UBYTE command;
+
+    for (ULONG i=0; i < extents; i++) {
+        count += ext[i].count;
     }
-}
 
-/**
- * ata_write_unaligned_long
- * 
- * Write data from an unaligned buffer
- * @param source Pointer to the data buffer
- * @param destination Pointer to the drive data port
-*/
-void ata_write_unaligned_long(void *source, void *destination) {
-    UBYTE *src = (UBYTE *)source;
-    for (int i=0; i<(512/4); i++) {  // Write (512 / 4) Long words to drive
-        *(ULONG *)destination = (src[0] << 24 | src[1] << 16 | src[2] << 8 | src[3]);
-        src += 4;
+    if (direction == READ) {
+        if (unit->lba48) {
+            command = ATA_CMD_READ_MULTIPLE_EXT;
+        } else {
+            command = (unit->xferMultiple) ? ATA_CMD_READ_MULTIPLE : ATA_CMD_READ;
+        }
+    } else {
+        if (unit->lba48) {
+            command = ATA_CMD_WRITE_MULTIPLE_EXT;
+        } else {
+            command = (unit->xferMultiple) ? ATA_CMD_WRITE_MULTIPLE : ATA_CMD_WRITE;
+        }
+    }
+
+    ULONG block_count;
+    ULONG multiple_count = unit->multipleCount;
+    UWORD block_shift    = unit->blockShift;
+    ULONG max_transfer   = unit->maxTransfer;
+
+    UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0;
+
+    *done = 0;
+
+    ata_select(unit,drvSel,true);
+
+    if (!ata_wait_ready(unit,ATA_RDY_WAIT_COUNT)) {
+        ata_save_error(unit);
+        return HFERR_SelTimeout;
+    }
+
+    buffer    = ext->buffer;
+    ext_count = ext->count;
+
+    while (count > 0) {
+        txn_count = (count >= max_transfer) ? max_transfer : count;
+        count -= txn_count;
+
+        if ((error = unit->write_taskfile(unit,command,lba,txn_count,0)) != 0) {
+            ata_save_error(unit);
+            return error;
+        }
+
+        lba += txn_count;
+
+        while (txn_count) {
+            if (!ata_wait_drq(unit,ATA_DRQ_WAIT_COUNT,true)) {
+                ata_save_error(unit);
+                return IOERR_UNITBUSY;
+            }
+
+            drq_block  = (txn_count > multiple_count) ? multiple_count : txn_count;
+            drq_count  = drq_block;
+            txn_count -= drq_block;
+
+            while (drq_count) {
+                while (ext_count == 0) {
+                    ext++;
+                    buffer    = ext->buffer;
+                    ext_count = ext->count;
+                }
+
+                block_count = (drq_count > ext_count) ? ext_count : drq_count;
+
+                if (direction == READ) {
+                    if ((ULONG)buffer & 0x01) {
+                        unit->read_unaligned((void *)unit->drive->data,buffer,block_count);
+                    } else {
+                        unit->read_fast((void *)unit->drive->data,buffer,block_count);
+                    }
+                } else {
+                    if ((ULONG)buffer & 0x01) {
+                        unit->write_unaligned(buffer,(void *)unit->drive->data,block_count);
+                    } else {
+                        unit->write_fast(buffer,(void *)unit->drive->data,block_count);
+                    }
+                }
+
+                buffer    += (block_count << block_shift);
+                ext_count -= block_count;
+                drq_count -= block_count;
+                *done     += block_count;
+            }
+
+            ata_burst(unit->itask,drq_block);
+        }
     }
+
+    return 0;
 }
 
 /**
@@ -643,7 +1109,7 @@ void ata_write_unaligned_long(void *source, void *destination) {
  * @param unit Pointer to an IDEUnit struct
  * @param lba  Pointer to the LBA variable
 */
-static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features) {
+static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features) {
     UWORD cylinder = (lba / (unit->heads * unit->sectorsPerTrack));
     UBYTE head     = ((lba / unit->sectorsPerTrack) % unit->heads) & 0xF;
     UBYTE sector   = (lba % unit->sectorsPerTrack) + 1;
@@ -655,14 +1121,19 @@ static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, U
 
     devHead = ((unit->primary) ? 0xA0 : 0xB0) | (head & 0x0F);
     
-    *unit->shadowDevHead         = devHead;
-    *unit->drive->devHead        = devHead;
-    *unit->drive->sectorCount    = sectorCount; // Count value of 0 indicates to transfer 256 sectors
-    *unit->drive->lbaLow         = (UBYTE)(sector);
-    *unit->drive->lbaMid         = (UBYTE)(cylinder);
-    *unit->drive->lbaHigh        = (UBYTE)(cylinder >> 8);
-    *unit->drive->error_features = features;
-    *unit->drive->status_command = command;
+    if (*unit->shadowDevHead != devHead) {
+        *unit->shadowDevHead  = devHead;
+        *unit->drive->devHead = devHead;
+        unit->itask->tfWrites++;
+    } else {
+        unit->itask->tfSkipped++;
+    }
+    ata_tf_write(unit,tf_sectorCount,(UBYTE)(sectorCount)); // Count value of 0 indicates to transfer 256 sectors
+    ata_tf_write(unit,tf_lbaLow,(UBYTE)(sector));
+    ata_tf_write(unit,tf_lbaMid,(UBYTE)(cylinder));
+    ata_tf_write(unit,tf_lbaHigh,(UBYTE)(cylinder >> 8));
+    ata_tf_write(unit,tf_features,features);
+    ata_tf_command(unit,command);
 
     return 0;
 }
@@ -673,7 +1144,7 @@ static BYTE write_taskfile_chs(struct IDEUnit *unit, UBYTE command, ULONG lba, U
  * @param unit Pointer to an IDEUnit struct
  * @param lba  Pointer to the LBA variable
 */
-static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features) {
+static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features) {
     BYTE devHead;
 
     if (!ata_wait_ready(unit,ATA_RDY_WAIT_COUNT))
@@ -681,14 +1152,19 @@ static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, U
 
     devHead = ((unit->primary) ? 0xE0 : 0xF0) | ((lba >> 24) & 0x0F);
 
-    *unit->shadowDevHead         = devHead;
-    *unit->drive->devHead        = devHead;
-    *unit->drive->sectorCount    = sectorCount; // Count value of 0 indicates to transfer 256 sectors
-    *unit->drive->lbaLow         = (UBYTE)(lba);
-    *unit->drive->lbaMid         = (UBYTE)(lba >> 8);
-    *unit->drive->lbaHigh        = (UBYTE)(lba >> 16);
-    *unit->drive->error_features = features;
-    *unit->drive->status_command = command;
+    if (*unit->shadowDevHead != devHead) {
+        *unit->shadowDevHead  = devHead;
+        *unit->drive->devHead = devHead;
+        unit->itask->tfWrites++;
+    } else {
+        unit->itask->tfSkipped++;
+    }
+    ata_tf_write(unit,tf_sectorCount,(UBYTE)(sectorCount)); // Count value of 0 indicates to transfer 256 sectors
+    ata_tf_write(unit,tf_lbaLow,(UBYTE)(lba));
+    ata_tf_write(unit,tf_lbaMid,(UBYTE)(lba >> 8));
+    ata_tf_write(unit,tf_lbaHigh,(UBYTE)(lba >> 16));
+    ata_tf_write(unit,tf_features,features);
+    ata_tf_command(unit,command);
 
     return 0;
 }
@@ -696,24 +1172,22 @@ static BYTE write_taskfile_lba(struct IDEUnit *unit, UBYTE command, ULONG lba, U
 /**
  * write_taskfile_lba48
  * 
+ * The sector count is written HOB first, a count of 0 transfers 65536 sectors
+ * 
  * @param unit Pointer to an IDEUnit struct
  * @param lba  Pointer to the LBA variable
 */
-static BYTE write_taskfile_lba48(struct IDEUnit *unit, UBYTE command, ULONG lba, UBYTE sectorCount, UBYTE features) {
+static BYTE write_taskfile_lba48(struct IDEUnit *unit, UBYTE command, ULONG lba, UWORD sectorCount, UBYTE features) {
 
     if (!ata_wait_ready(unit,ATA_RDY_WAIT_COUNT))
         return HFERR_SelTimeout;
 
-    *unit->drive->sectorCount    = (sectorCount == 0) ? 1 : 0;
-    *unit->drive->lbaHigh        = 0;
-    *unit->drive->lbaMid         = 0;
-    *unit->drive->lbaLow         = (UBYTE)(lba >> 24);
-    *unit->drive->sectorCount    = sectorCount; // Count value of 0 indicates to transfer 256 sectors
-    *unit->drive->lbaHigh        = (UBYTE)(lba >> 16);
-    *unit->drive->lbaMid         = (UBYTE)(lba >> 8);
-    *unit->drive->lbaLow         = (UBYTE)(lba);
-    *unit->drive->error_features = features;
-    *unit->drive->status_command = command;
+    ata_tf_write_pair(unit,tf_sectorCount,(UBYTE)(sectorCount >> 8),(UBYTE)(sectorCount)); // Count value of 0 indicates to transfer 65536 sectors
+    ata_tf_write_pair(unit,tf_lbaLow,(UBYTE)(lba >> 24),(UBYTE)(lba));
+    ata_tf_write_pair(unit,tf_lbaMid,0,(UBYTE)(lba >> 8));
+    ata_tf_write_pair(unit,tf_lbaHigh,0,(UBYTE)(lba >> 16));
+    ata_tf_write(unit,tf_features,features);
+    ata_tf_command(unit,command);
 
     return 0;
 }
@@ -743,6 +1217,136 @@ BYTE ata_set_pio(struct IDEUnit *unit, UBYTE pio) {
     return 0;
 }
 
+/**
+ * ata_set_features
+ * 
+ * Issue a SET FEATURES command to the drive
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param feature Subcommand
+ * @param count Value for the sector count register
+ * @returns non-zero on error
+*/
+static BYTE ata_set_features(struct IDEUnit *unit, UBYTE feature, UBYTE count) {
+    UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0; // Select drive
+    BYTE error;
+
+    ata_select(unit,drvSel,true);
+
+    if ((error = write_taskfile_lba(unit,ATA_CMD_SET_FEATURES,0,count,feature)) != 0)
+        return error;
+
+    if (!ata_wait_not_busy(unit,ATA_BSY_WAIT_COUNT))
+        return IOERR_UNITBUSY;
+
+    if (ata_check_error(unit)) {
+        ata_save_error(unit);
+        return IOERR_ABORTED;
+    }
+
+    return 0;
+}
+
+/**
+ * ata_set_write_cache
+ * 
+ * Enable or disable the drive write cache
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param enable true to enable the write cache
+ * @returns non-zero on error
+*/
+BYTE ata_set_write_cache(struct IDEUnit *unit, bool enable) {
+    BYTE error;
+
+    if (!unit->writeCacheSupported) return IOERR_NOCMD;
+
+    // Don't leave anything in the cache when turning it off
+    if (!enable && (error = ata_flush_cache(unit)) != 0)
+        return error;
+
+    if ((error = ata_set_features(unit,(enable) ? ATA_FEATURE_WCACHE_ON : ATA_FEATURE_WCACHE_OFF,0)) == 0) {
+        unit->writeCache = enable;
+    }
+
+    return error;
+}
+
+/**
+ * ata_set_policy
+ * 
+ * Apply the performance policy to the drive, where the drive supports each feature:
+ * Read look-ahead is enabled, APM is set to ATA_APM_LEVEL and AAM to ATA_AAM_LEVEL
+ * A failure to set one feature is not fatal, the drive is just left as it was.
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param identify Pointer to IDENTIFY data for the unit
+*/
+static void ata_set_policy(struct IDEUnit *unit, UWORD *identify) {
+    UWORD supported = identify[ata_identify_features];
+    UWORD enabled   = identify[ata_identify_enabled2];
+
+    unit->lookAhead = (identify[ata_identify_enabled] & ata_command_set_lookahead) != 0;
+    unit->apmLevel  = (enabled & ata_feature_apm) ? identify[ata_identify_apm_level] & 0xFF : 0;
+    unit->aamLevel  = (enabled & ata_feature_aam) ? identify[ata_identify_aam_level] & 0xFF : 0;
+
+    if ((identify[ata_identify_command_set] & ata_command_set_lookahead) && !unit->lookAhead) {
+        if (ata_set_features(unit,ATA_FEATURE_LOOKAHEAD_ON,0) == 0) unit->lookAhead = true;
+    }
+
+    if (supported & ata_feature_apm && unit->apmLevel != ATA_APM_LEVEL) {
+        if (ATA_APM_LEVEL == 0 && ata_set_features(unit,ATA_FEATURE_APM_OFF,0) == 0) {
+            unit->apmLevel = 0;
+        } else if (ata_set_features(unit,ATA_FEATURE_APM_ON,(ATA_APM_LEVEL == 0) ? 0xFE : ATA_APM_LEVEL) == 0) {
+            // Some drives can't turn APM off, use maximum performance instead
+            unit->apmLevel = (ATA_APM_LEVEL == 0) ? 0xFE : ATA_APM_LEVEL;
+        }
+    }
+
+    if (supported & ata_feature_aam && unit->aamLevel != ATA_AAM_LEVEL) {
+        if (ATA_AAM_LEVEL == 0) {
+            if (ata_set_features(unit,ATA_FEATURE_AAM_OFF,0) == 0) unit->aamLevel = 0;
+        } else {
+            if (ata_set_features(unit,ATA_FEATURE_AAM_ON,ATA_AAM_LEVEL) == 0) unit->aamLevel = ATA_AAM_LEVEL;
+        }
+    }
+
+    Info("INIT: Look-ahead: %ld APM: %02lx AAM: %02lx\n",(ULONG)unit->lookAhead,(ULONG)unit->apmLevel,(ULONG)unit->aamLevel);
+}
+
+/**
+ * ata_flush_cache
+ * 
+ * Write out the contents of the drive write cache
+ * Does nothing if the write cache is not enabled
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+BYTE ata_flush_cache(struct IDEUnit *unit) {
+    UBYTE drvSel = (unit->primary) ? 0xE0 : 0xF0; // Select drive
+    UBYTE command = (unit->lba48 && unit->flushExt) ? ATA_CMD_FLUSH_CACHE_EXT : ATA_CMD_FLUSH_CACHE;
+    BYTE error;
+
+    if (!unit->writeCache) return 0;
+
+    ata_select(unit,drvSel,true);
+
+    if ((error = unit->write_taskfile(unit,command,0,0,0)) != 0)
+        return error;
+
+    if (!ata_wait_not_busy(unit,ATA_FLUSH_WAIT_COUNT))
+        return IOERR_UNITBUSY;
+
+    if (ata_check_error(unit)) {
+        ata_save_error(unit);
+        Warn("ATA: FLUSH CACHE failed\n");
+        return TDERR_NotSpecified;
+    }
+
+    return 0;
+}
+
 /**
  * scsi_ata_passthrough
  * 
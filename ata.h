@@ -14,6 +14,13 @@
 #error "MAX_TRANSFER_SECTORS cannot be larger than 256"
 #endif
 
+#ifndef MAX_TRANSFER_SECTORS_LBA48
+#define MAX_TRANSFER_SECTORS_LBA48 65536 // Max amount of sectors to transfer per READ/WRITE MULTIPLE EXT command
+#endif
+#if MAX_TRANSFER_SECTORS_LBA48 > 65536
+#error "MAX_TRANSFER_SECTORS_LBA48 cannot be larger than 65536"
+#endif
+
 #define CHANNEL_0 0x1000
 #define CHANNEL_1 0x2000
 #define NEXT_REG   0x200
@@ -36,11 +43,24 @@
 #define ata_flag_busy  (1<<7)
 #define ata_flag_ready (1<<6)
 #define ata_flag_df    (1<<5)
+#define ata_flag_serv  (1<<4) // Overlapped ATAPI device wants service, in place of DSC
 #define ata_flag_drq   (1<<3)
 #define ata_flag_error (1<<0)
 
 #define ata_err_flag_aborted (1<<2)
 
+// Index into IDETask->shadowTaskFile, in register order from Features
+enum tf_reg {
+    tf_features,
+    tf_sectorCount,
+    tf_lbaLow,
+    tf_lbaMid,
+    tf_lbaHigh
+};
+
+// Registers the drive may overwrite while executing a command (status outputs, ATAPI byte count etc)
+#define TF_DEVICE_OWNED ((1<<tf_sectorCount) | (1<<tf_lbaLow) | (1<<tf_lbaMid) | (1<<tf_lbaHigh))
+
 #define ATA_CMD_DEVICE_RESET       0x08
 #define ATA_CMD_IDENTIFY           0xEC
 #define ATA_CMD_READ               0x20
@@ -51,6 +71,30 @@
 #define ATA_CMD_WRITE_MULTIPLE_EXT 0x39
 #define ATA_CMD_SET_MULTIPLE       0xC6
 #define ATA_CMD_SET_FEATURES       0xEF
+#define ATA_CMD_FLUSH_CACHE        0xE7
+#define ATA_CMD_FLUSH_CACHE_EXT    0xEA
+
+// SET FEATURES subcommands
+#define ATA_FEATURE_WCACHE_ON      0x02
+#define ATA_FEATURE_WCACHE_OFF     0x82
+#define ATA_FEATURE_APM_ON         0x05
+#define ATA_FEATURE_APM_OFF        0x85
+#define ATA_FEATURE_AAM_ON         0x42
+#define ATA_FEATURE_AAM_OFF        0xC2
+#define ATA_FEATURE_LOOKAHEAD_ON   0xAA
+
+// Performance policy applied by ata_set_policy
+#ifndef ATA_APM_LEVEL
+#define ATA_APM_LEVEL 0xFE // APM level 1-254, 0xFE is maximum performance. 0 disables APM
+#endif
+
+#ifndef ATA_AAM_LEVEL
+#define ATA_AAM_LEVEL 0xFE // AAM level 0x80-0xFE, 0xFE is fastest seek. 0 disables AAM
+#endif
+
+#ifndef ATA_WRITE_CACHE
+#define ATA_WRITE_CACHE 1 // Enable the drive write cache at init if it can be controlled
+#endif
 
 // Identify data word offsets
 #define ata_identify_cylinders       1
@@ -63,43 +107,154 @@
 #define ata_identify_capabilities    49
 #define ata_identify_logical_sectors 60
 #define ata_identify_pio_modes       64
+#define ata_identify_command_set     82
 #define ata_identify_features        83
+#define ata_identify_enabled         85
+#define ata_identify_enabled2        86
+#define ata_identify_apm_level       91
+#define ata_identify_aam_level       94
 #define ata_identify_lba48_sectors   100
+#define ata_identify_rotation        217
 #define ataf_multiple (1<<8)
 
 #define ata_capability_lba (1<<9)
 #define ata_capability_dma (1<<8)
+#define ata_capability_overlap (1<<13) // ATAPI only
 #define ata_feature_lba48  (1<<10)
+#define ata_feature_flush_ext  (1<<13)
+#define ata_command_set_wcache (1<<5)
+#define ata_command_set_lookahead (1<<6)
+#define ata_feature_apm        (1<<3)
+#define ata_feature_aam        (1<<9)
+#define ata_rotation_none      1
 
 enum xfer_dir {
     READ,
     WRITE
 };
 
-#define ATA_DRQ_WAIT_LOOP_US 1000
+// Wait timeouts in milliseconds
 #define ATA_DRQ_WAIT_S 5
-#define ATA_DRQ_WAIT_COUNT (ATA_DRQ_WAIT_S * 1000 * (1000 / ATA_DRQ_WAIT_LOOP_US))
+#define ATA_DRQ_WAIT_COUNT (ATA_DRQ_WAIT_S * 1000)
 
-#define ATA_BSY_WAIT_LOOP_US 1000
 #define ATA_BSY_WAIT_S 10
-#define ATA_BSY_WAIT_COUNT (ATA_BSY_WAIT_S * 1000 * (1000 / ATA_BSY_WAIT_LOOP_US))
+#define ATA_BSY_WAIT_COUNT (ATA_BSY_WAIT_S * 1000)
 
-#define ATA_RDY_WAIT_LOOP_US 1000
 #define ATA_RDY_WAIT_S 3
-#define ATA_RDY_WAIT_COUNT (ATA_RDY_WAIT_S * 1000 * (1000 / ATA_RDY_WAIT_LOOP_US))
+#define ATA_RDY_WAIT_COUNT (ATA_RDY_WAIT_S * 1000)
+
+#define ATA_FLUSH_WAIT_S 30
+#define ATA_FLUSH_WAIT_COUNT (ATA_FLUSH_WAIT_S * 1000)
+
+#define WAIT_SPIN_US        100  // Time spent polling the status register before backing off
+#define WAIT_SPIN_FAST_US   1000 // Spin budget for DRQ between data blocks
+#define WAIT_BACKOFF_MIN_US 16   // First delay after the spin, doubled on each miss
+#define WAIT_BACKOFF_MAX_US 1000 // Delays are capped here, from then on the task sleeps on the timer
+#define WAIT_POLLS_PER_MS   250  // Status polls per ms if the EClock isn't available to calibrate
+#define WAIT_CALIBRATE_POLLS 1000
+
+#ifndef BURST_BUDGET_US
+#define BURST_BUDGET_US 0 // CPU time a transfer may hold the CPU before yielding to ready tasks, 0 never yields
+#endif
+#define BURST_YIELD_US      1000 // Time given to other tasks at each yield
+#define BURST_US_PER_BLOCK  500  // Estimated cost of a block on a 68000 for when the EClock isn't available
+
+#define XFER_BENCH_PASSES 16 // Number of IDENTIFY transfers timed for each transfer method
+
+/**
+ * ata_tf_write
+ * 
+ * Write a taskfile register unless the shadow copy shows it already holds the value
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param reg Register to write
+ * @param value Value to write
+*/
+static inline void ata_tf_write(struct IDEUnit *unit, enum tf_reg reg, UBYTE value) {
+    struct IDETask *itask = unit->itask;
+
+    if ((itask->shadowValid & (1 << reg)) && itask->shadowTaskFile[reg] == value) {
+        itask->tfSkipped++;
+        return;
+    }
+
+    *((volatile UBYTE *)unit->drive + ata_reg_features + (reg * NEXT_REG)) = value;
+    itask->shadowTaskFile[reg] = value;
+    itask->shadowValid        |= (1 << reg);
+    itask->tfWrites++;
+}
+
+/**
+ * ata_tf_write_pair
+ * 
+ * Write the previous (HOB) and current values of an LBA48 register
+ * The registers are two-deep FIFOs so the HOB write can only be skipped if the drive holds it as the current value,
+ * the current value is then always written to push it into place.
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param reg Register to write
+ * @param hob High order byte
+ * @param value Low order byte
+*/
+static inline void ata_tf_write_pair(struct IDEUnit *unit, enum tf_reg reg, UBYTE hob, UBYTE value) {
+    struct IDETask *itask = unit->itask;
+    volatile UBYTE *r = (volatile UBYTE *)unit->drive + ata_reg_features + (reg * NEXT_REG);
+
+    if ((itask->shadowValid & (1 << reg)) && itask->shadowTaskFile[reg] == hob) {
+        itask->tfSkipped++;
+    } else {
+        *r = hob;
+        itask->tfWrites++;
+    }
+
+    *r = value;
+    itask->shadowTaskFile[reg] = value;
+    itask->shadowValid        |= (1 << reg);
+    itask->tfWrites++;
+}
+
+/**
+ * ata_tf_command
+ * 
+ * Write the command register, after this the drive owns the LBA and count registers so their shadows are dropped
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param command Command to issue
+*/
+static inline void ata_tf_command(struct IDEUnit *unit, UBYTE command) {
+    *unit->drive->status_command = command;
+    unit->itask->shadowValid    &= ~TF_DEVICE_OWNED;
+    unit->itask->tfWrites++;
+}
 
+/**
+ * ata_tf_invalidate
+ * 
+ * Forget the shadow taskfile, used after errors, resets and drive switches
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+static inline void ata_tf_invalidate(struct IDETask *itask) {
+    itask->shadowValid = 0;
+}
 
 bool ata_init_unit(struct IDEUnit *);
 bool ata_select(struct IDEUnit *unit, UBYTE select, bool wait);
 bool ata_identify(struct IDEUnit *, UWORD *);
 bool ata_set_multiple(struct IDEUnit *unit, BYTE multiple);
 void ata_set_xfer(struct IDEUnit *unit, enum xfer method);
+void ata_sleep(struct IDEUnit *unit, ULONG micros);
+void ata_calibrate_wait(struct IDETask *itask);
+void ata_set_burst(struct IDETask *itask, ULONG micros);
+void ata_burst_start(struct IDETask *itask);
+bool ata_wait_status(struct IDEUnit *unit, UBYTE mask, UBYTE match, UBYTE abort, ULONG spin_us, ULONG timeout_ms);
 
 BYTE ata_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit);
 BYTE ata_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit);
+BYTE ata_transfer_extents(struct ATAExtent *ext, ULONG extents, ULONG lba, enum xfer_dir direction, ULONG *done, struct IDEUnit *unit);
 BYTE ata_set_pio(struct IDEUnit *unit, UBYTE pio);
+BYTE ata_set_write_cache(struct IDEUnit *unit, bool enable);
+BYTE ata_flush_cache(struct IDEUnit *unit);
 BYTE scsi_ata_passthrough( struct IDEUnit *unit, struct SCSICmd *cmd);
 
-void ata_read_unaligned_long(void *source, void *destination);
-void ata_write_unaligned_long(void *source, void *destination);
 #endif
\ No newline at end of file
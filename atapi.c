@@ -17,6 +17,7 @@
 #include "device.h"
 #include "ata.h"
 #include "atapi.h"
+#include "idetask.h"
 #include "scsi.h"
 #include "string.h"
 #include "wait.h"
@@ -39,77 +40,48 @@ static void  __attribute__((always_inline)) atapi_status_reg_delay(struct IDEUni
 /**
  * atapi_wait_drq
  * 
- * Poll DRQ in the status register until set or timeout
+ * Wait for DRQ in the status register until set or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool atapi_wait_drq(struct IDEUnit *unit, ULONG tries) {
-    Trace("atapi_wait_drq enter\n");
-    struct timerequest *tr = unit->itask->tr;
     atapi_status_reg_delay(unit);
-    for (int i=0; i < tries; i++) {
-        if ((*unit->drive->status_command & ata_flag_drq) != 0) return true;
-        wait_us(tr,ATAPI_DRQ_WAIT_LOOP_US);
-    }
-    Trace("atapi_wait_drq timeout\n");
-    return false;
+    return ata_wait_status(unit,ata_flag_drq,ata_flag_drq,0,WAIT_SPIN_US,tries);
 }
 
 /**
  * atapi_wait_drq_not_bsy
  * 
- * Poll the status register until DRQ set and BSY clear or timeout
+ * Wait for the status register to have DRQ set and BSY clear or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool atapi_wait_drq_not_bsy(struct IDEUnit *unit, ULONG tries) {
-    struct timerequest *tr = unit->itask->tr;
     atapi_status_reg_delay(unit);
-
-    for (int i=0; i < tries; i++) {
-        if ((*unit->drive->status_command & (ata_flag_busy | ata_flag_drq)) == ata_flag_drq) return true;
-        wait_us(tr,ATAPI_DRQ_WAIT_LOOP_US);
-    }
-    return false;
+    return ata_wait_status(unit,(ata_flag_busy | ata_flag_drq),ata_flag_drq,0,WAIT_SPIN_US,tries);
 }
 
 /**
  * atapi_wait_not_bsy
  * 
- * Poll BSY in the status register until clear or timeout
+ * Wait for BSY in the status register to clear or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool atapi_wait_not_bsy(struct IDEUnit *unit, ULONG tries) {
-    Trace("atapi_wait_not_bsy enter\n");
-    struct timerequest *tr = unit->itask->tr;
-
-    for (int i=0; i < tries; i++) {
-        if ((*unit->drive->status_command & ata_flag_busy) == 0) return true;
-        wait_us(tr,ATAPI_BSY_WAIT_LOOP_US);
-    }
-    Trace("atapi_wait_not_bsy timeout\n");
-    return false;
+    return ata_wait_status(unit,ata_flag_busy,0,0,WAIT_SPIN_US,tries);
 }
 
 /**
  * atapi_wait_not_drqbsy
  * 
- * Poll DRQ & BSY in the status register until clear or timeout
+ * Wait for DRQ & BSY in the status register to clear or timeout
  * @param unit Pointer to an IDEUnit struct
- * @param tries Tries, sets the timeout
+ * @param tries Timeout in ms
 */
 static bool atapi_wait_not_drqbsy(struct IDEUnit *unit, ULONG tries) {
-    Trace("atapi_wait_not_drqbsy enter\n");
-    struct timerequest *tr = unit->itask->tr;
     atapi_status_reg_delay(unit);
-
-    for (int i=0; i < tries; i++) {
-        if ((*(volatile BYTE *)unit->drive->status_command & (ata_flag_busy | ata_flag_drq)) == 0) return true;
-        wait_us(tr,ATAPI_BSY_WAIT_LOOP_US);
-    }
-    Trace("atapi_wait_not_drqbsy timeout\n");
-    return false;
+    return ata_wait_status(unit,(ata_flag_busy | ata_flag_drq),0,0,WAIT_SPIN_US,tries);
 }
 
 /**
@@ -142,6 +114,7 @@ void atapi_dev_reset(struct IDEUnit *unit) {
     Info("ATAPI: Resetting device\n");
     atapi_wait_not_bsy(unit,10);
     *unit->drive->status_command = ATA_CMD_DEVICE_RESET;
+    ata_tf_invalidate(unit->itask);
     atapi_wait_not_bsy(unit,ATAPI_BSY_WAIT_COUNT);
 
 }
@@ -182,12 +155,12 @@ bool atapi_identify(struct IDEUnit *unit, UWORD *buffer) {
     //if (!atapi_wait_rdy(unit,ATAPI_RDY_WAIT_COUNT))
     //        return HFERR_SelTimeout;
 
-    *unit->drive->sectorCount    = 0;
-    *unit->drive->lbaLow         = 0;
-    *unit->drive->lbaMid         = 0;
-    *unit->drive->lbaHigh        = 0;
-    *unit->drive->error_features = 0;
-    *unit->drive->status_command = ATAPI_CMD_IDENTIFY;
+    ata_tf_write(unit,tf_sectorCount,0);
+    ata_tf_write(unit,tf_lbaLow,0);
+    ata_tf_write(unit,tf_lbaMid,0);
+    ata_tf_write(unit,tf_lbaHigh,0);
+    ata_tf_write(unit,tf_features,0);
+    ata_tf_command(unit,ATAPI_CMD_IDENTIFY);
 
     if (!atapi_wait_drq(unit,ATAPI_DRQ_WAIT_COUNT)) {
         if (*unit->drive->status_command & (ata_flag_error | ata_flag_df)) {
@@ -214,6 +187,46 @@ bool atapi_identify(struct IDEUnit *unit, UWORD *buffer) {
     return true;
 }
 
+/**
+ * atapi_spinning_up
+ * 
+ * Check if the unit is becoming ready and it is too soon to check on it again
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns true if requests to the medium should fail without being sent to the unit
+*/
+bool atapi_spinning_up(struct IDEUnit *unit) {
+    if (!unit->becomingReady) return false;
+
+    return ((LONG)(get_time_ms(unit->itask->tr) - unit->readyPoll) < 0);
+}
+
+/**
+ * atapi_becoming_ready
+ * 
+ * Note that the unit reported it is becoming ready, and when to check on it next
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns true if it has been becoming ready for longer than ATAPI_READY_TIMEOUT_MS and should be treated as having no medium
+*/
+static bool atapi_becoming_ready(struct IDEUnit *unit) {
+    ULONG now = get_time_ms(unit->itask->tr);
+
+    if (!unit->becomingReady) {
+        unit->becomingReady = true;
+        unit->readySince    = now;
+    }
+
+    unit->readyPoll = now + ATAPI_READY_POLL_MS;
+
+    if ((now - unit->readySince) >= ATAPI_READY_TIMEOUT_MS) {
+        unit->becomingReady = false;
+        return true;
+    }
+
+    return false;
+}
+
 /**
  * atapi_translate
  * 
@@ -230,6 +243,9 @@ bool atapi_identify(struct IDEUnit *unit, UWORD *buffer) {
 BYTE atapi_translate(APTR io_Data, ULONG lba, ULONG count, ULONG *io_Actual, struct IDEUnit *unit, enum xfer_dir direction) 
 {
     Trace("atapi_translate enter\n");
+    // Don't hold up the other unit on the channel while the medium spins up, the request is parked instead, see sched_park
+    if (atapi_spinning_up(unit)) return IOERR_UNITBUSY;
+
     struct SCSICmd *cmd = MakeSCSICmd(SZ_CDB_10);
     if (cmd == NULL) return TDERR_NoMem;
     struct SCSI_CDB_10 *cdb = (struct SCSI_CDB_10 *)cmd->scsi_Command;
@@ -279,9 +295,13 @@ BYTE atapi_translate(APTR io_Data, ULONG lba, ULONG count, ULONG *io_Actual, str
 
                     case 0x02:                       // Unit not ready
                         if (asc == 0x4) {            // Becoming ready
-                            ret = TDERR_DiskChanged;
-                            wait(unit->itask->tr,1);   // Wait
-                            continue;                // and try again
+                            if (atapi_becoming_ready(unit)) {
+                                ret = TDERR_DiskChanged; // Gave up on it, see atapi_test_unit_ready
+                                atapi_update_presence(unit,false);
+                            } else {
+                                ret = IOERR_UNITBUSY;    // Don't wait for it, the request is parked
+                            }
+                            goto done;
                         } else {
                             ret = TDERR_DiskChanged; // No media
                             atapi_update_presence(unit,false);
@@ -311,6 +331,7 @@ BYTE atapi_translate(APTR io_Data, ULONG lba, ULONG count, ULONG *io_Actual, str
 
 done:
     Trace("atapi_packet returns %ld\n",ret);
+    if (err == 0) unit->becomingReady = false;
     *io_Actual = cmd->scsi_Actual;
     
     DeleteSCSICmd(cmd);
@@ -320,6 +341,49 @@ done:
 
 #pragma GCC optimize ("-O3")
 
+/**
+ * atapi_overlap_release
+ * 
+ * Called when the device has released the channel during an overlapped PACKET command
+ * 
+ * Queued ATA transfers for the other unit on the channel are served until the device sets SERV,
+ * then it is selected again and sent a SERVICE command so that the PACKET command can carry on.
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns nonzero if the device didn't ask for service in time
+*/
+static BYTE atapi_overlap_release(struct IDEUnit *unit) {
+    struct IDETask *itask = unit->itask;
+    volatile UBYTE *status = unit->drive->status_command;
+    UBYTE drvSelHead = ((unit->primary) ? 0xE0 : 0xF0);
+    ULONG deadline;
+
+    itask->releases++;
+
+    // The deadline covers the whole release, however long the other unit's transfers take
+    deadline = get_time_ms(itask->tr) + ATAPI_SERVICE_WAIT_MS;
+
+    while (1) {
+        // Between the slices of a transfer the other unit's requests must stay in order, so just wait
+        if (itask->slicing || ide_serve_overlapped(itask,unit) == 0) {
+            wait_us(itask->tr,1000);
+        }
+
+        ata_select(unit,drvSelHead,true);
+        atapi_status_reg_delay(unit);
+
+        if (*status & ata_flag_serv) {
+            ata_tf_command(unit,ATAPI_CMD_SERVICE);
+            return 0;
+        }
+
+        if ((LONG)(get_time_ms(itask->tr) - deadline) >= 0) break;
+    }
+
+    Warn("ATAPI: No service request after release\n");
+    return IOERR_UNITBUSY;
+}
+
 /**
  * atapi_packet
  * 
@@ -333,6 +397,8 @@ BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit) {
     Trace("atapi_packet\n");
     LONG byte_count = 0;
     LONG remaining;
+    ULONG block_size;
+    ULONG chunk;
     UWORD data;
     BYTE ret = 0;
     UBYTE senseKey;
@@ -361,17 +427,19 @@ BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit) {
         goto end;
     }
 
-    if (cmd->scsi_Length > 65534) {
-        byte_count = 65534;
+    // Limit each DRQ chunk to a whole number of blocks so that it can be moved with the sector routines
+    if (cmd->scsi_Length > ATAPI_MAX_BYTE_COUNT) {
+        block_size = (unit->blockSize >= 512) ? unit->blockSize : 512;
+        byte_count = ATAPI_MAX_BYTE_COUNT - (ATAPI_MAX_BYTE_COUNT % block_size);
     } else {
         byte_count = cmd->scsi_Length;
     }
 
-    *unit->drive->lbaMid         = byte_count & 0xFF; 
-    *unit->drive->lbaHigh        = byte_count >> 8 & 0xFF;
-    *unit->drive->error_features = 0;
+    ata_tf_write(unit,tf_lbaMid,byte_count & 0xFF);
+    ata_tf_write(unit,tf_lbaHigh,byte_count >> 8 & 0xFF);
+    ata_tf_write(unit,tf_features,(unit->overlap) ? atapi_feature_ovl : 0);
     *unit->drive->devHead        = drvSelHead;
-    *unit->drive->status_command = ATAPI_CMD_PACKET;
+    ata_tf_command(unit,ATAPI_CMD_PACKET);
 
     if (!atapi_wait_drq_not_bsy(unit,ATAPI_DRQ_WAIT_COUNT)) {
         Trace("ATAPI: Packet bsy timeout\n");
@@ -415,6 +483,12 @@ BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit) {
           goto end;
         }
 
+        if (unit->overlap && !(*status & ata_flag_drq) && atapi_check_ir(unit,0x07,atapi_flag_rel,1)) {
+            // The device released the channel to seek, serve the other unit until it wants service
+            if ((ret = atapi_overlap_release(unit)) != 0) goto end;
+            continue;
+        }
+
         if (cmd->scsi_Length == 0) break;
 
         if ((atapi_check_ir(unit,0x03,IR_STATUS,1))) break;
@@ -425,40 +499,35 @@ BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit) {
         byte_count = *unit->drive->lbaHigh << 8 | *unit->drive->lbaMid;
         byte_count += (byte_count & 0x01); // Ensure that the byte count is always an even number
 
+        remaining = cmd->scsi_Length - cmd->scsi_Actual;
+
+        if (remaining > 0) {
+            // An odd length buffer still takes a whole word at the end
+            chunk = (byte_count < remaining) ? byte_count : (remaining + 1) & ~1;
+
+            if (cmd->scsi_Flags & SCSIF_READ) {
+                if (chunk >= 512) unit->read_fast((void *)unit->drive->data, cmd->scsi_Data + index, chunk >> 9);
+                if (chunk & 511) atapi_read_words((void *)unit->drive->data, cmd->scsi_Data + index + ((chunk & ~511) >> 1), chunk & 511);
+            } else {
+                if (chunk >= 512) unit->write_fast(cmd->scsi_Data + index, (void *)unit->drive->data, chunk >> 9);
+                if (chunk & 511) atapi_write_words(cmd->scsi_Data + index + ((chunk & ~511) >> 1), (void *)unit->drive->data, chunk & 511);
+            }
+
+            index += chunk >> 1;
+            cmd->scsi_Actual += chunk;
+            byte_count -= chunk;
+        }
+
+        // If we got here the drive wanted to transfer more data than the buffer could take
+        //
+        // Make the drive happy by reading/writing some more...
         while (byte_count > 0) {
-            remaining = cmd->scsi_Length - cmd->scsi_Actual;
-
-            if ((byte_count >= 512 && remaining >= 512)) {
-              // 512 or more bytes to transfer, use the fast ATA transfer routines
-              if (cmd->scsi_Flags & SCSIF_READ) {
-                  unit->read_fast((void *)unit->drive->data, cmd->scsi_Data + index);
-              } else {
-                  unit->write_fast(cmd->scsi_Data + index, (void *)unit->drive->data);
-              }
-              index += 256;
-              cmd->scsi_Actual += 512;
-              byte_count -= 512;
-            } else if (remaining > 0) {
-                // Less than 512 bytes means we can't use the fast ATA transfer routines, copy word-by-word
-                if (cmd->scsi_Flags & SCSIF_READ) {
-                    cmd->scsi_Data[index] = *unit->drive->data;
-                } else {
-                    *unit->drive->data = cmd->scsi_Data[index];
-                }
-                index++;
-                cmd->scsi_Actual+=2;
-                byte_count -= 2;
+            if (cmd->scsi_Flags & SCSIF_READ) {
+                *unit->drive->data;
             } else {
-                // If we got here the drive wanted to transfer more data than the buffer could take
-                //
-                // Make the drive happy by reading/writing some more...
-                if (cmd->scsi_Flags & SCSIF_READ) {
-                    *unit->drive->data;
-                } else {
-                    *unit->drive->data = 0;
-                }
-                byte_count -= 2;
+                *unit->drive->data = 0;
             }
+            byte_count -= 2;
         }
     }
 
@@ -477,6 +546,7 @@ BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit) {
 end:
     if (*status & ata_flag_error) {
  ata_error:
+        ata_tf_invalidate(unit->itask);
         unit->last_error[0] = *unit->drive->error_features;
         unit->last_error[1] = *unit->drive->status_command;
         unit->last_error[2] = *unit->drive->sectorCount;
@@ -504,10 +574,15 @@ end:
  * 
  * Send a TEST UNIT READY to the unit and update the media change count & presence
  * 
+ * A unit that is becoming ready is not waited for, that would hold up every request for the other unit on the channel.
+ * Instead it is left alone for ATAPI_READY_POLL_MS and IOERR_UNITBUSY is returned without changing the medium presence.
+ * 
  * @param unit Pointer to an IDEUnit struct
- * @returns nonzero if there was an error
+ * @returns nonzero if there was an error, IOERR_UNITBUSY if the unit is becoming ready
 */
 BYTE atapi_test_unit_ready(struct IDEUnit *unit) {
+    if (atapi_spinning_up(unit)) return IOERR_UNITBUSY;
+
     struct SCSICmd *cmd = MakeSCSICmd(SZ_CDB_10);
     if (cmd == NULL) return TDERR_NoMem;
     struct SCSI_CDB_10 *cdb = (struct SCSI_CDB_10 *)cmd->scsi_Command;
@@ -533,9 +608,13 @@ BYTE atapi_test_unit_ready(struct IDEUnit *unit) {
                 switch (senseKey) {
                     case 0x02: // Not ready
                         if (asc == 4) { // Becoming ready
-                            // The medium is becoming ready, wait a few seconds before checking again
-                            ret = TDERR_DiskChanged;
-                            if (tries > 0) wait(unit->itask->tr,3);
+                            if (atapi_becoming_ready(unit)) {
+                                // Still not ready after ATAPI_READY_TIMEOUT_MS, give up on it
+                                ret = TDERR_DiskChanged;
+                                goto done;
+                            }
+                            ret = IOERR_UNITBUSY;
+                            goto busy;
                         } else { // Anything else - No medium/bad medium etc
                             ret = TDERR_DiskChanged;
                             goto done;
@@ -564,12 +643,97 @@ BYTE atapi_test_unit_ready(struct IDEUnit *unit) {
     }
 
 done:
+    unit->becomingReady = false;
     atapi_update_presence(unit,(ret == 0)); // Update the media presence
+busy:
     DeleteSCSICmd(cmd);
 
     return ret;
 }
 
+/**
+ * atapi_get_media_event
+ * 
+ * Poll the media event class with GET EVENT STATUS NOTIFICATION
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param event Pointer for the media event code
+ * @param present Pointer for the media present flag
+ * @returns nonzero if the command failed, IOERR_NOCMD if the drive doesn't report media events
+*/
+static BYTE atapi_get_media_event(struct IDEUnit *unit, UBYTE *event, bool *present) {
+    UWORD buf[4];
+    UBYTE *data = (UBYTE *)buf;
+    BYTE ret;
+
+    struct SCSICmd *cmd = MakeSCSICmd(SZ_CDB_10);
+    if (cmd == NULL) return TDERR_NoMem;
+
+    cmd->scsi_Data       = buf;
+    cmd->scsi_Length     = sizeof(buf);
+    cmd->scsi_Flags      = SCSIF_READ;
+    cmd->scsi_Command[0] = SCSI_CMD_GET_EVENT_STATUS;
+    cmd->scsi_Command[1] = 0x01; // Polled
+    cmd->scsi_Command[4] = (1 << ATAPI_GESN_CLASS_MEDIA);
+    cmd->scsi_Command[8] = sizeof(buf);
+
+    if ((ret = atapi_packet(cmd,unit)) == 0) {
+        if (cmd->scsi_Actual < sizeof(buf) || (data[2] & ATAPI_GESN_NEA) || (data[2] & 0x07) != ATAPI_GESN_CLASS_MEDIA) {
+            ret = IOERR_NOCMD;
+        } else {
+            *event   = data[4] & 0x0F;
+            *present = (data[5] & ATAPI_MEDIA_PRESENT) != 0;
+        }
+    }
+
+    DeleteSCSICmd(cmd);
+
+    return ret;
+}
+
+/**
+ * atapi_check_media
+ * 
+ * Check for a medium change, for the disk change poll
+ * 
+ * If the drive supports media events and has nothing new to report then the last known state is returned
+ * without sending TEST UNIT READY, which would also need a REQUEST SENSE each time the drive is empty.
+ * Otherwise this goes on to atapi_test_unit_ready.
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns same as atapi_test_unit_ready
+*/
+BYTE atapi_check_media(struct IDEUnit *unit) {
+    UBYTE event  = 0;
+    bool present = false;
+    BYTE ret;
+
+    if (!unit->gesn || unit->becomingReady) return atapi_test_unit_ready(unit);
+
+    if ((ret = atapi_get_media_event(unit,&event,&present)) == 0) {
+        if (event == ATAPI_MEDIA_NO_CHANGE && present == unit->mediumPresent) {
+            return (present) ? 0 : TDERR_DiskChanged;
+        }
+        return atapi_test_unit_ready(unit);
+    }
+
+    if (ret == IOERR_NOCMD) {
+        Info("ATAPI: No media events, polling with TEST UNIT READY\n");
+        unit->gesn = false;
+        return atapi_test_unit_ready(unit);
+    }
+
+    // Drives without the command reject it, but so might one with a unit attention pending
+    // Only give up on it once the drive has shown it is otherwise ready
+    ret = atapi_test_unit_ready(unit);
+    if (ret == 0) {
+        Info("ATAPI: GET EVENT STATUS NOTIFICATION failed, polling with TEST UNIT READY\n");
+        unit->gesn = false;
+    }
+
+    return ret;
+}
+
 /**
  * atapi_request_sense
  * 
@@ -955,6 +1119,32 @@ BYTE atapi_start_stop_unit(struct IDEUnit *unit, bool start, bool loej) {
     return ret;
 }
 
+/**
+ * atapi_sync_cache
+ * 
+ * Send a SYNCHRONIZE CACHE (10) command to write out any cached data on the medium
+ * CD/DVD drives have nothing to write back so this is skipped for them
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+BYTE atapi_sync_cache(struct IDEUnit *unit) {
+    struct SCSICmd *cmd = NULL;
+    UBYTE ret;
+
+    if (unit->deviceType == DG_CDROM || !unit->mediumPresent) return 0;
+
+    if ((cmd = MakeSCSICmd(SZ_CDB_10)) == NULL) return TDERR_NoMem;
+
+    cmd->scsi_Command[0] = SCSI_CMD_SYNCHRONIZE_CACHE_10;
+
+    ret = atapi_packet(cmd,unit);
+
+    DeleteSCSICmd(cmd);
+
+    return ret;
+}
+
 /**
  * atapi_check_wp
  * 
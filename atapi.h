@@ -12,6 +12,7 @@
 
 #define atapi_flag_cd (1<<0)
 #define atapi_flag_io (1<<1)
+#define atapi_flag_rel (1<<2) // Device released the bus during an overlapped command
 
 #define atapi_err_abort (1<<2)
 #define atapi_err_eom   (1<<1)
@@ -19,14 +20,34 @@
 
 #define ATAPI_CMD_PACKET   0xA0
 #define ATAPI_CMD_IDENTIFY 0xA1
+#define ATAPI_CMD_SERVICE  0xA2
 
-#define ATAPI_DRQ_WAIT_LOOP_US 1000
+#define atapi_feature_ovl (1<<1) // PACKET features bit to allow the device to release the bus
+
+#ifndef ATAPI_OVERLAP
+#define ATAPI_OVERLAP 0 // Use overlapped PACKET commands on drives that support them
+#endif
+
+#define ATAPI_SERVICE_WAIT_MS 10000 // Longest time a released device can take to ask for service
+#define ATAPI_MAX_BYTE_COUNT  65534 // Largest byte count limit for a PACKET command, rounded down to whole blocks
+
+// Wait timeouts in milliseconds
 #define ATAPI_DRQ_WAIT_MS 500
-#define ATAPI_DRQ_WAIT_COUNT (ATAPI_DRQ_WAIT_MS * (1000 / ATAPI_DRQ_WAIT_LOOP_US))
+#define ATAPI_DRQ_WAIT_COUNT ATAPI_DRQ_WAIT_MS
 
-#define ATAPI_BSY_WAIT_LOOP_US 1000
 #define ATAPI_BSY_WAIT_S 5
-#define ATAPI_BSY_WAIT_COUNT (ATAPI_BSY_WAIT_S * 1000 * (1000 / ATAPI_BSY_WAIT_LOOP_US))
+#define ATAPI_BSY_WAIT_COUNT (ATAPI_BSY_WAIT_S * 1000)
+
+// Spin-up tracking, see atapi_test_unit_ready
+#define ATAPI_READY_POLL_MS    500   // Leave a unit that is becoming ready alone for this long between checks
+#define ATAPI_READY_TIMEOUT_MS 30000 // Report no medium if it is still becoming ready after this long
+#define ATAPI_SENSE_RETRY_US   10000 // Delay between autosense retries
+
+// GET EVENT STATUS NOTIFICATION
+#define ATAPI_GESN_CLASS_MEDIA 4    // Media event class, request with (1 << ATAPI_GESN_CLASS_MEDIA)
+#define ATAPI_GESN_NEA         0x80 // No event available, the requested class is not supported
+#define ATAPI_MEDIA_NO_CHANGE  0    // Media event code for nothing new to report
+#define ATAPI_MEDIA_PRESENT    (1<<1)
 
 #define IR_PIO_W   0x0
 #define IR_COMMAND 0x1
@@ -41,14 +62,17 @@ BYTE atapi_scsi_read_write_6 (struct SCSICmd *cmd, struct IDEUnit *unit);
 BYTE atapi_packet_unaligned(struct SCSICmd *cmd, struct IDEUnit *unit);
 BYTE atapi_packet(struct SCSICmd *cmd, struct IDEUnit *unit);
 BYTE atapi_test_unit_ready(struct IDEUnit *unit);
+BYTE atapi_check_media(struct IDEUnit *unit);
 BYTE atapi_get_capacity(struct IDEUnit *unit);
 BYTE atapi_request_sense(struct IDEUnit *unit, UBYTE *errorCode, UBYTE *senseKey, UBYTE *asc, UBYTE *asq);
 BYTE atapi_mode_sense(struct IDEUnit *unit, BYTE page_code, BYTE subpage_code, UWORD *buffer, UWORD length, UWORD *actual, BOOL dbd);
 BYTE atapi_scsi_mode_sense_6(struct SCSICmd *cmd, struct IDEUnit *unit);
 BYTE atapi_scsi_mode_select_6(struct SCSICmd *cmd, struct IDEUnit *unit);
 BYTE atapi_start_stop_unit(struct IDEUnit *unit, bool start, bool loej);
+BYTE atapi_sync_cache(struct IDEUnit *unit);
 BYTE atapi_check_wp(struct IDEUnit *unit);
 bool atapi_update_presence(struct IDEUnit *unit, bool present);
+bool atapi_spinning_up(struct IDEUnit *unit);
 void atapi_do_defer_tur(struct IDEUnit *unit, UBYTE cmd);
 BYTE atapi_read_toc(struct IDEUnit *unit, BYTE *buf, ULONG bufSize);
 BOOL atapi_get_track_msf(struct SCSI_CD_TOC *toc, int trackNum, struct SCSI_TRACK_MSF *msf);
@@ -0,0 +1,915 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#include <devices/scsidisk.h>
+#include <devices/trackdisk.h>
+#include <exec/errors.h>
+#include <exec/execbase.h>
+#include <exec/memory.h>
+#include <proto/exec.h>
+#include <stdbool.h>
+
+#include "debug.h"
+#include "device.h"
+#include "ata.h"
+#include "blockcache.h"
+#include "wait.h"
+
+/**
+ * cache_hash
+ *
+ * @param lba Block address
+ * @returns Hash bucket for the block
+*/
+static inline ULONG cache_hash(ULONG lba) {
+    return lba & (BLOCK_CACHE_HASH_SIZE - 1);
+}
+
+/**
+ * cache_lookup
+ *
+ * Find a block in a hash table
+ *
+ * @param hash Hash table of a BlockCache or WriteBack struct
+ * @param lba Block address
+ * @returns Pointer to the CacheBlock or NULL if not cached
+*/
+static struct CacheBlock *cache_lookup(struct CacheBlock **hash, ULONG lba) {
+    struct CacheBlock *block;
+
+    for (block = hash[cache_hash(lba)]; block != NULL; block = block->hashNext) {
+        if (block->lba == lba) return block;
+    }
+
+    return NULL;
+}
+
+/**
+ * cache_touch
+ *
+ * Move a block to the head of the LRU list
+ *
+ * @param cache Pointer to a BlockCache struct
+ * @param block Pointer to a CacheBlock struct
+*/
+static inline void cache_touch(struct BlockCache *cache, struct CacheBlock *block) {
+    Remove((struct Node *)block);
+    AddHead((struct List *)&cache->lru,(struct Node *)block);
+}
+
+/**
+ * cache_unhash
+ *
+ * Remove a block from its hash chain
+ *
+ * @param hash Hash table of a BlockCache or WriteBack struct
+ * @param block Pointer to a CacheBlock struct
+*/
+static void cache_unhash(struct CacheBlock **hash, struct CacheBlock *block) {
+    struct CacheBlock **link = &hash[cache_hash(block->lba)];
+
+    while (*link != block) link = &(*link)->hashNext;
+
+    *link = block->hashNext;
+}
+
+/**
+ * cache_drop
+ *
+ * Remove a block from the cache and free it
+ *
+ * @param cache Pointer to a BlockCache struct
+ * @param block Pointer to a CacheBlock struct
+*/
+static void cache_drop(struct BlockCache *cache, struct CacheBlock *block) {
+    struct ExecBase *SysBase = cache->SysBase;
+
+    cache_unhash(cache->hash,block);
+    Remove((struct Node *)block);
+    FreeMem(block,sizeof(struct CacheBlock) + cache->blockSize);
+    cache->numBlocks--;
+}
+
+/**
+ * cache_trim
+ *
+ * Free least recently used blocks until no more than keep remain
+ *
+ * @param cache Pointer to a BlockCache struct
+ * @param keep Number of blocks to keep
+*/
+static void cache_trim(struct BlockCache *cache, ULONG keep) {
+    while (cache->numBlocks > keep) {
+        cache_drop(cache,(struct CacheBlock *)cache->lru.mlh_TailPred);
+    }
+}
+
+/**
+ * cache_alloc
+ *
+ * Get a block for lba, allocating a new one until the cache is full and then recycling the least recently used
+ * The block is placed at the head of the LRU list, the caller fills in the data
+ *
+ * @param cache Pointer to a BlockCache struct
+ * @param lba Block address
+ * @returns Pointer to a CacheBlock or NULL if none could be had
+*/
+static struct CacheBlock *cache_alloc(struct BlockCache *cache, ULONG lba) {
+    struct CacheBlock *block = NULL;
+
+    if (cache->numBlocks < cache->maxBlocks) {
+        block = AllocMem(sizeof(struct CacheBlock) + cache->blockSize,MEMF_ANY);
+    }
+
+    if (block != NULL) {
+        cache->numBlocks++;
+    } else {
+        if (cache->numBlocks == 0) return NULL;
+
+        block = (struct CacheBlock *)cache->lru.mlh_TailPred;
+        cache_unhash(cache->hash,block);
+        Remove((struct Node *)block);
+    }
+
+    block->lba      = lba;
+    block->hashNext = cache->hash[cache_hash(lba)];
+    cache->hash[cache_hash(lba)] = block;
+    AddHead((struct List *)&cache->lru,(struct Node *)block);
+
+    return block;
+}
+
+/**
+ * cache_check_change
+ *
+ * Throw away the cache contents if the medium has been changed since they were read
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+static void cache_check_change(struct IDEUnit *unit) {
+    struct BlockCache *cache = unit->cache;
+
+    if (cache->changeCount != unit->changeCount) {
+        cache_trim(cache,0);
+        cache->changeCount = unit->changeCount;
+    }
+}
+
+/**
+ * cache_mem_handler
+ *
+ * Low memory handler, gives all cached blocks back to the system
+ * This runs on the context of the task doing the allocation with Forbid,
+ * if the IDE task is working on the cache at the time there's nothing that can be done.
+ *
+ * @param mhd Pointer to a MemHandlerData struct
+ * @param cache Pointer to the BlockCache struct
+ * @returns MEM_ALL_DONE if memory was freed
+*/
+static LONG __attribute__((used)) cache_mem_handler(struct MemHandlerData *mhd asm("a0"), struct BlockCache *cache asm("a1")) {
+    struct ExecBase *SysBase = cache->SysBase;
+
+    if (cache->numBlocks == 0 || cache->sem.ss_Owner == SysBase->ThisTask) return MEM_DID_NOTHING;
+
+    if (!AttemptSemaphore(&cache->sem)) return MEM_DID_NOTHING;
+
+    cache_trim(cache,0);
+
+    ReleaseSemaphore(&cache->sem);
+
+    return MEM_ALL_DONE;
+}
+
+/**
+ * cache_wb_overlay
+ *
+ * Copy any dirty blocks held in the write-back cache over data just read from the drive
+ *
+ * @param buffer Buffer holding the blocks read
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+*/
+static void cache_wb_overlay(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+    struct CacheBlock *block;
+    UBYTE *buf = buffer;
+
+    if (wb == NULL || wb->numBlocks == 0) return;
+
+    if (count <= wb->numBlocks) {
+        for (ULONG i=0; i < count; i++) {
+            if ((block = cache_lookup(wb->hash,lba + i)) != NULL)
+                CopyMem(block->data,buf + (i << wb->blockShift),wb->blockSize);
+        }
+    } else {
+        for (block = (struct CacheBlock *)wb->dirty.mlh_Head;
+             block->node.mln_Succ != NULL;
+             block = (struct CacheBlock *)block->node.mln_Succ) {
+            if (block->lba >= lba && block->lba < lba + count)
+                CopyMem(block->data,buf + ((block->lba - lba) << wb->blockShift),wb->blockSize);
+        }
+    }
+}
+
+/**
+ * cache_fill
+ *
+ * Read blocks from the drive for the caches, with any newer data from the write-back cache laid over them
+ *
+ * @param buffer Destination buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+static BYTE cache_fill(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    BYTE error;
+
+    if ((error = ata_read(buffer,lba,count,unit)) == 0)
+        cache_wb_overlay(buffer,lba,count,unit);
+
+    return error;
+}
+
+/**
+ * cache_wb_remove
+ *
+ * Remove a block from the write-back cache and free it
+ *
+ * @param wb Pointer to a WriteBack struct
+ * @param block Pointer to a CacheBlock struct
+*/
+static void cache_wb_remove(struct WriteBack *wb, struct CacheBlock *block) {
+    struct ExecBase *SysBase = wb->SysBase;
+
+    cache_unhash(wb->hash,block);
+    Remove((struct Node *)block);
+    FreeMem(block,sizeof(struct CacheBlock) + wb->blockSize);
+    wb->numBlocks--;
+}
+
+/**
+ * cache_wb_discard
+ *
+ * Drop dirty blocks in a range, used when a write that goes straight to the drive supersedes them
+ *
+ * @param wb Pointer to a WriteBack struct
+ * @param lba First block
+ * @param count Number of blocks
+*/
+static void cache_wb_discard(struct WriteBack *wb, ULONG lba, ULONG count) {
+    struct CacheBlock *block, *next;
+
+    for (block = (struct CacheBlock *)wb->dirty.mlh_Head;
+         block->node.mln_Succ != NULL;
+         block = next) {
+        next = (struct CacheBlock *)block->node.mln_Succ;
+
+        if (block->lba >= lba + count) break;
+        if (block->lba >= lba) cache_wb_remove(wb,block);
+    }
+}
+
+/**
+ * cache_wb_mem_handler
+ *
+ * Low memory handler for the write-back cache
+ * Dirty blocks can only be freed once they are written, which can't be done from here,
+ * so this just asks the IDE task to flush.
+ *
+ * @param mhd Pointer to a MemHandlerData struct
+ * @param wb Pointer to the WriteBack struct
+ * @returns MEM_DID_NOTHING
+*/
+static LONG __attribute__((used)) cache_wb_mem_handler(struct MemHandlerData *mhd asm("a0"), struct WriteBack *wb asm("a1")) {
+    struct ExecBase *SysBase = wb->SysBase;
+
+    if (wb->numBlocks > 0 && !wb->flushPending) {
+        wb->flushPending = true;
+        Signal(wb->task,wb->sigMask);
+    }
+
+    return MEM_DID_NOTHING;
+}
+
+/**
+ * cache_wb_free
+ *
+ * Free the write-back cache of a unit, any dirty blocks are lost
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+static void cache_wb_free(struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+
+    if (wb == NULL) return;
+
+    if (wb->numBlocks > 0) Warn("Cache: unit %ld: discarding %ld dirty blocks\n",unit->unitNum,wb->numBlocks);
+
+    if (wb->memHandlerAdded) RemMemHandler(&wb->memHandler);
+
+    while (wb->numBlocks > 0) {
+        cache_wb_remove(wb,(struct CacheBlock *)wb->dirty.mlh_Head);
+    }
+
+    unit->writeBack = NULL;
+    FreeMem(wb->bounce,wb->bounceSize);
+    FreeMem(wb,sizeof(struct WriteBack));
+}
+
+/**
+ * cache_writeback
+ *
+ * Write all dirty blocks to the drive
+ *
+ * Runs of adjacent dirty blocks are gathered into the bounce buffer and written with a single command.
+ * When an alignment is set each run is widened to whole aligned chunks, the blocks that aren't dirty are read in first
+ * so that flash media see whole erase blocks written. If that read fails the run is written unaligned instead.
+ *
+ * If a write fails its blocks stay dirty and the flush stops there, the error is kept for cache_flush to report.
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cache_writeback(struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+    struct CacheBlock *block, *next;
+    ULONG align, start, end, chunk, dirty;
+    BYTE error;
+
+    if (wb == NULL) return;
+
+    wb->flushPending = false;
+    align = wb->align;
+
+    while (wb->numBlocks > 0) {
+        block = (struct CacheBlock *)wb->dirty.mlh_Head;
+        start = block->lba & ~(align - 1);
+        end   = start;
+        dirty = 0;
+
+        for (; block->node.mln_Succ != NULL; block = (struct CacheBlock *)block->node.mln_Succ) {
+            chunk = block->lba & ~(align - 1);
+
+            if (chunk > end || chunk + align - start > WRITE_BACK_RUN_BLOCKS) break;
+
+            if (chunk + align > end) end = chunk + align;
+            dirty++;
+        }
+
+        if (end > unit->logicalSectors) end = unit->logicalSectors;
+
+        if (dirty < end - start && ata_read(wb->bounce,start,end - start,unit) != 0) {
+            Warn("Cache: unit %ld: read for aligned flush failed\n",unit->unitNum);
+            align = 1;
+            continue;
+        }
+
+        block = (struct CacheBlock *)wb->dirty.mlh_Head;
+        for (ULONG i=0; i < dirty; i++) {
+            CopyMem(block->data,wb->bounce + ((block->lba - start) << wb->blockShift),wb->blockSize);
+            block = (struct CacheBlock *)block->node.mln_Succ;
+        }
+
+        wb->writes++;
+
+        if ((error = ata_write(wb->bounce,start,end - start,unit)) != 0) {
+            Warn("Cache: unit %ld: flush of %ld blocks at %ld failed\n",unit->unitNum,end - start,start);
+            if (wb->error == 0) wb->error = error;
+            break;
+        }
+
+        for (block = (struct CacheBlock *)wb->dirty.mlh_Head; dirty > 0; dirty--, block = next) {
+            next = (struct CacheBlock *)block->node.mln_Succ;
+            cache_wb_remove(wb,block);
+        }
+
+        wb->written += end - start;
+        align = wb->align;
+    }
+}
+
+/**
+ * cache_flush
+ *
+ * Write all dirty blocks to the drive and report any error since the last cache_flush,
+ * including those of flushes done in the background
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero if a write failed
+*/
+BYTE cache_flush(struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+    BYTE error;
+
+    if (wb == NULL) return 0;
+
+    cache_writeback(unit);
+
+    error     = wb->error;
+    wb->error = 0;
+
+    return error;
+}
+
+/**
+ * cache_idle
+ *
+ * Flush the dirty blocks once no write has been taken for WRITE_BACK_IDLE_MS
+ * Called by the IDE task each time the change task polls
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cache_idle(struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+
+    if (wb == NULL || wb->numBlocks == 0) return;
+
+    if (get_time_ms(unit->itask->tr) - wb->lastWrite >= WRITE_BACK_IDLE_MS) cache_writeback(unit);
+}
+
+/**
+ * cache_wb_absorb
+ *
+ * Take a write into the write-back cache
+ * The cache is flushed first if the write would take it over its limit
+ *
+ * @param buffer Source buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns true if the write was taken, false if it has to go to the drive
+*/
+static bool cache_wb_absorb(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    struct WriteBack *wb = unit->writeBack;
+    struct CacheBlock *block, *prev;
+    UBYTE *buf = buffer;
+
+    // Once a reset is under way nothing may be left in the cache, see ide_reset_flush
+    if (unit->itask->resetting || count > WRITE_BACK_RUN_BLOCKS || count > wb->maxBlocks) return false;
+
+    if (wb->numBlocks + count > wb->maxBlocks) {
+        // Blocks that failed to write stay dirty, if there is still no room the write goes through
+        cache_writeback(unit);
+        if (wb->numBlocks + count > wb->maxBlocks) return false;
+    }
+
+    for (ULONG i=0; i < count; i++) {
+        if ((block = cache_lookup(wb->hash,lba + i)) == NULL) {
+            if ((block = AllocMem(sizeof(struct CacheBlock) + wb->blockSize,MEMF_ANY)) == NULL) {
+                // Keep what was taken so far, the caller writes the whole request through
+                return false;
+            }
+
+            block->lba      = lba + i;
+            block->hashNext = wb->hash[cache_hash(lba + i)];
+            wb->hash[cache_hash(lba + i)] = block;
+
+            // Writes are mostly ascending so search for the insert position from the tail
+            for (prev = (struct CacheBlock *)wb->dirty.mlh_TailPred;
+                 prev->node.mln_Pred != NULL && prev->lba > block->lba;
+                 prev = (struct CacheBlock *)prev->node.mln_Pred);
+
+            Insert((struct List *)&wb->dirty,(struct Node *)block,(prev->node.mln_Pred != NULL) ? (struct Node *)prev : NULL);
+            wb->numBlocks++;
+        }
+
+        CopyMem(buf + (i << wb->blockShift),block->data,wb->blockSize);
+    }
+
+    wb->absorbed  += count;
+    wb->lastWrite  = get_time_ms(unit->itask->tr);
+
+    return true;
+}
+
+/**
+ * cache_set_writeback
+ *
+ * Set the dirty block limit and flush alignment of the write-back cache of a unit
+ * Any dirty blocks are flushed first, setting the limit to 0 disables write-back
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param blocks Largest number of dirty blocks held
+ * @param align Flush alignment in blocks, a power of 2 up to WRITE_BACK_RUN_BLOCKS, 0 for none
+ * @returns non-zero on error
+*/
+BYTE cache_set_writeback(struct IDEUnit *unit, ULONG blocks, ULONG align) {
+    struct WriteBack *wb;
+    BYTE error;
+
+    if (align == 0) align = 1;
+
+    if (blocks > WRITE_BACK_MAX_BLOCKS || align > WRITE_BACK_RUN_BLOCKS || (align & (align - 1)))
+        return IOERR_BADLENGTH;
+
+    if ((error = cache_flush(unit)) != 0) return error;
+
+    cache_wb_free(unit);
+
+    if (blocks == 0) return 0;
+
+    if ((wb = AllocMem(sizeof(struct WriteBack),MEMF_ANY|MEMF_CLEAR)) == NULL) return TDERR_NoMem;
+
+    wb->bounceSize = WRITE_BACK_RUN_BLOCKS << unit->blockShift;
+
+    if ((wb->bounce = AllocMem(wb->bounceSize,MEMF_ANY)) == NULL) {
+        FreeMem(wb,sizeof(struct WriteBack));
+        return TDERR_NoMem;
+    }
+
+    wb->dirty.mlh_Tail     = NULL;
+    wb->dirty.mlh_Head     = (struct MinNode *)&wb->dirty.mlh_Tail;
+    wb->dirty.mlh_TailPred = (struct MinNode *)&wb->dirty;
+
+    wb->SysBase    = unit->SysBase;
+    wb->task       = unit->itask->task;
+    wb->sigMask    = 1 << unit->itask->iomp->mp_SigBit;
+    wb->maxBlocks  = blocks;
+    wb->align      = align;
+    wb->blockSize  = unit->blockSize;
+    wb->blockShift = unit->blockShift;
+
+    wb->memHandler.is_Node.ln_Type = NT_INTERRUPT;
+    wb->memHandler.is_Node.ln_Pri  = 0;
+    wb->memHandler.is_Node.ln_Name = "lide write-back";
+    wb->memHandler.is_Data         = wb;
+    wb->memHandler.is_Code         = (void *)cache_wb_mem_handler;
+
+    if (SysBase->SoftVer >= 39) {
+        AddMemHandler(&wb->memHandler);
+        wb->memHandlerAdded = true;
+    }
+
+    unit->writeBack = wb;
+
+    Info("Cache: unit %ld: write-back %ld blocks, align %ld\n",unit->unitNum,blocks,align);
+
+    return 0;
+}
+
+/**
+ * cache_set_size
+ *
+ * Set the maximum number of blocks cached for a unit
+ * The cache is set up on first use, setting the size to 0 frees all of the blocks
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param blocks Number of blocks
+ * @returns non-zero on error
+*/
+BYTE cache_set_size(struct IDEUnit *unit, ULONG blocks) {
+    struct BlockCache *cache = unit->cache;
+
+    if (blocks > BLOCK_CACHE_MAX_BLOCKS) return IOERR_BADLENGTH;
+
+    if (cache == NULL) {
+        if (blocks == 0) return 0;
+
+        if ((cache = AllocMem(sizeof(struct BlockCache),MEMF_ANY|MEMF_CLEAR)) == NULL) return TDERR_NoMem;
+
+        InitSemaphore(&cache->sem);
+
+        cache->lru.mlh_Tail     = NULL;
+        cache->lru.mlh_Head     = (struct MinNode *)&cache->lru.mlh_Tail;
+        cache->lru.mlh_TailPred = (struct MinNode *)&cache->lru;
+
+        cache->SysBase     = unit->SysBase;
+        cache->blockSize   = unit->blockSize;
+        cache->blockShift  = unit->blockShift;
+        cache->changeCount = unit->changeCount;
+
+        cache->memHandler.is_Node.ln_Type = NT_INTERRUPT;
+        cache->memHandler.is_Node.ln_Pri  = 0;
+        cache->memHandler.is_Node.ln_Name = "lide cache";
+        cache->memHandler.is_Data         = cache;
+        cache->memHandler.is_Code         = (void *)cache_mem_handler;
+
+        // Memory handlers are only available from V39
+        if (SysBase->SoftVer >= 39) {
+            AddMemHandler(&cache->memHandler);
+            cache->memHandlerAdded = true;
+        }
+
+        unit->cache = cache;
+    }
+
+    ObtainSemaphore(&cache->sem);
+    cache->maxBlocks = blocks;
+    cache_trim(cache,blocks);
+    ReleaseSemaphore(&cache->sem);
+
+    Info("Cache: unit %ld: %ld blocks\n",unit->unitNum,blocks);
+
+    return 0;
+}
+
+/**
+ * cache_free
+ *
+ * Free the caches of a unit, the write-back cache must have been flushed first
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cache_free(struct IDEUnit *unit) {
+    struct BlockCache *cache = unit->cache;
+
+    cache_set_readahead(unit,0);
+    cache_wb_free(unit);
+
+    if (cache == NULL) return;
+
+    if (cache->memHandlerAdded) RemMemHandler(&cache->memHandler);
+
+    cache_trim(cache,0);
+    FreeMem(cache,sizeof(struct BlockCache));
+    unit->cache = NULL;
+}
+
+/**
+ * cache_invalidate
+ *
+ * Throw away all cached blocks of a unit
+ * Used when the drive contents may have changed behind the cache e.g. by ATA PASSTHROUGH
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cache_invalidate(struct IDEUnit *unit) {
+    struct BlockCache *cache = unit->cache;
+
+    if (unit->readAhead) unit->readAhead->numBlocks = 0;
+
+    if (cache == NULL) return;
+
+    ObtainSemaphore(&cache->sem);
+    cache_trim(cache,0);
+    ReleaseSemaphore(&cache->sem);
+}
+
+/**
+ * cache_read_blocks
+ *
+ * Read blocks through the LRU cache
+ * If every block is cached the request is served from RAM, otherwise the whole request is read from the drive
+ * and the blocks that were missing are added to the cache.
+ *
+ * @param buffer Destination buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+static BYTE cache_read_blocks(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    struct BlockCache *cache = unit->cache;
+    struct CacheBlock *block;
+    UBYTE *buf = buffer;
+    ULONG hits = 0;
+    BYTE error;
+
+    if (cache == NULL || cache->maxBlocks == 0 || count > BLOCK_CACHE_MAX_REQUEST)
+        return cache_fill(buffer,lba,count,unit);
+
+    ObtainSemaphore(&cache->sem);
+    cache_check_change(unit);
+
+    for (ULONG i=0; i < count; i++) {
+        if (cache_lookup(cache->hash,lba + i) != NULL) hits++;
+    }
+
+    if (hits == count) {
+        for (ULONG i=0; i < count; i++) {
+            block = cache_lookup(cache->hash,lba + i);
+            CopyMem(block->data,buf + (i << cache->blockShift),cache->blockSize);
+            cache_touch(cache,block);
+        }
+        cache->hits += count;
+        ReleaseSemaphore(&cache->sem);
+        return 0;
+    }
+
+    // Let the memory handler at the cache while waiting on the drive
+    ReleaseSemaphore(&cache->sem);
+
+    if ((error = cache_fill(buffer,lba,count,unit)) != 0) return error;
+
+    ObtainSemaphore(&cache->sem);
+    for (ULONG i=0; i < count; i++) {
+        if ((block = cache_lookup(cache->hash,lba + i)) != NULL) {
+            cache_touch(cache,block);
+        } else if ((block = cache_alloc(cache,lba + i)) != NULL) {
+            CopyMem(buf + (i << cache->blockShift),block->data,cache->blockSize);
+        }
+    }
+    cache->hits   += hits;
+    cache->misses += count - hits;
+    ReleaseSemaphore(&cache->sem);
+
+    return 0;
+}
+
+/**
+ * cache_set_readahead
+ *
+ * Set the largest read-ahead window of a unit
+ * The prefetch buffer is allocated up front to hold a full window, setting the size to 0 frees it
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param blocks Number of blocks
+ * @returns non-zero on error
+*/
+BYTE cache_set_readahead(struct IDEUnit *unit, ULONG blocks) {
+    struct ReadAhead *ra = unit->readAhead;
+
+    if (blocks > READ_AHEAD_MAX_BLOCKS) return IOERR_BADLENGTH;
+
+    if (ra != NULL) {
+        unit->readAhead = NULL;
+        FreeMem(ra->buffer,ra->bufSize);
+        FreeMem(ra,sizeof(struct ReadAhead));
+    }
+
+    if (blocks == 0) return 0;
+
+    if ((ra = AllocMem(sizeof(struct ReadAhead),MEMF_ANY|MEMF_CLEAR)) == NULL) return TDERR_NoMem;
+
+    ra->bufSize = blocks << unit->blockShift;
+
+    if ((ra->buffer = AllocMem(ra->bufSize,MEMF_ANY)) == NULL) {
+        FreeMem(ra,sizeof(struct ReadAhead));
+        return TDERR_NoMem;
+    }
+
+    ra->maxBlocks   = blocks;
+    ra->window      = (blocks < READ_AHEAD_MIN_BLOCKS) ? blocks : READ_AHEAD_MIN_BLOCKS;
+    ra->changeCount = unit->changeCount;
+
+    unit->readAhead = ra;
+
+    Info("Cache: unit %ld: read-ahead %ld blocks\n",unit->unitNum,blocks);
+
+    return 0;
+}
+
+/**
+ * cache_readahead
+ *
+ * Serve a read from the prefetch buffer, refilling it with a whole window when a sequential stream runs past it
+ * Requests that are not part of a stream, or are as large as the window, are passed on to cache_read_blocks
+ *
+ * @param buffer Destination buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+static BYTE cache_readahead(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    struct ReadAhead *ra = unit->readAhead;
+    UBYTE *buf = buffer;
+    ULONG n;
+    BYTE error;
+
+    if (ra->changeCount != unit->changeCount) {
+        ra->numBlocks   = 0;
+        ra->changeCount = unit->changeCount;
+    }
+
+    if (lba == ra->nextLba) {
+        if (ra->seqCount < READ_AHEAD_TRIGGER) ra->seqCount++;
+    } else {
+        ra->seqCount = 0;
+        ra->window   = (ra->maxBlocks < READ_AHEAD_MIN_BLOCKS) ? ra->maxBlocks : READ_AHEAD_MIN_BLOCKS;
+    }
+
+    ra->nextLba = lba + count;
+
+    while (count > 0) {
+        if (lba >= ra->lba && lba < ra->lba + ra->numBlocks) {
+            n = ra->lba + ra->numBlocks - lba;
+            if (n > count) n = count;
+
+            CopyMem(ra->buffer + ((lba - ra->lba) << unit->blockShift),buf,n << unit->blockShift);
+
+            ra->hits += n;
+            lba      += n;
+            count    -= n;
+            buf      += n << unit->blockShift;
+            continue;
+        }
+
+        if (ra->seqCount < READ_AHEAD_TRIGGER || count >= ra->window)
+            return cache_read_blocks(buf,lba,count,unit);
+
+        n = ra->window;
+        if (lba + n > unit->logicalSectors) n = unit->logicalSectors - lba;
+
+        ra->numBlocks = 0;
+
+        if ((error = cache_fill(ra->buffer,lba,n,unit)) != 0) return error;
+
+        ra->lba         = lba;
+        ra->numBlocks   = n;
+        ra->prefetched += n;
+
+        if (ra->window < ra->maxBlocks) {
+            ra->window <<= 1;
+            if (ra->window > ra->maxBlocks) ra->window = ra->maxBlocks;
+        }
+    }
+
+    return 0;
+}
+
+/**
+ * cache_read
+ *
+ * Read blocks through the read-ahead buffer and the block cache
+ *
+ * @param buffer Destination buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+BYTE cache_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    if (unit->readAhead != NULL)
+        return cache_readahead(buffer,lba,count,unit);
+
+    return cache_read_blocks(buffer,lba,count,unit);
+}
+
+/**
+ * cache_write
+ *
+ * Write blocks to the drive, or to the write-back cache when enabled, and update any copies held in the cache and read-ahead buffer
+ * If the write fails the cached copies are dropped as the contents of the drive are unknown
+ *
+ * @param buffer Source buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+BYTE cache_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit) {
+    struct BlockCache *cache = unit->cache;
+    struct ReadAhead *ra = unit->readAhead;
+    struct WriteBack *wb = unit->writeBack;
+    struct CacheBlock *block, *next;
+    UBYTE *buf = buffer;
+    BYTE error = 0;
+
+    if (wb == NULL || !cache_wb_absorb(buffer,lba,count,unit)) {
+        // Anything held for these blocks is older than this write
+        if (wb != NULL) cache_wb_discard(wb,lba,count);
+        error = ata_write(buffer,lba,count,unit);
+    }
+
+    if (ra != NULL && lba < ra->lba + ra->numBlocks && lba + count > ra->lba) {
+        if (error) {
+            ra->numBlocks = 0;
+        } else {
+            ULONG first = (lba > ra->lba) ? lba : ra->lba;
+            ULONG last  = (lba + count < ra->lba + ra->numBlocks) ? lba + count : ra->lba + ra->numBlocks;
+
+            CopyMem(buf + ((first - lba) << unit->blockShift),
+                    ra->buffer + ((first - ra->lba) << unit->blockShift),
+                    (last - first) << unit->blockShift);
+        }
+    }
+
+    if (cache == NULL || cache->numBlocks == 0) return error;
+
+    ObtainSemaphore(&cache->sem);
+    cache_check_change(unit);
+
+    if (count <= cache->numBlocks) {
+        for (ULONG i=0; i < count; i++) {
+            if ((block = cache_lookup(cache->hash,lba + i)) == NULL) continue;
+
+            if (error) {
+                cache_drop(cache,block);
+            } else {
+                CopyMem(buf + (i << cache->blockShift),block->data,cache->blockSize);
+            }
+        }
+    } else {
+        // Large write, cheaper to walk the cache than look up every block
+        for (block = (struct CacheBlock *)cache->lru.mlh_Head;
+             block->node.mln_Succ != NULL;
+             block = next) {
+            next = (struct CacheBlock *)block->node.mln_Succ;
+
+            if (block->lba < lba || block->lba >= lba + count) continue;
+
+            if (error) {
+                cache_drop(cache,block);
+            } else {
+                CopyMem(buf + ((block->lba - lba) << cache->blockShift),block->data,cache->blockSize);
+            }
+        }
+    }
+
+    ReleaseSemaphore(&cache->sem);
+
+    return error;
+}
@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#ifndef _BLOCKCACHE_H
+#define _BLOCKCACHE_H
+
+#include <exec/interrupts.h>
+#include <exec/semaphores.h>
+#include <exec/types.h>
+#include <stdbool.h>
+#include "device.h"
+
+#ifndef BLOCK_CACHE_BLOCKS
+#define BLOCK_CACHE_BLOCKS 0 // Default cache size per ATA unit in blocks, 0 disables the cache
+#endif
+
+#define BLOCK_CACHE_MAX_BLOCKS  8192 // Largest cache size that can be set per unit
+#define BLOCK_CACHE_MAX_REQUEST 16   // Reads larger than this go straight to the drive
+#define BLOCK_CACHE_HASH_SIZE   64   // Number of hash buckets, must be a power of 2
+
+#ifndef READ_AHEAD_BLOCKS
+#define READ_AHEAD_BLOCKS 0 // Default read-ahead window limit per ATA unit in blocks, 0 disables read-ahead
+#endif
+
+#define READ_AHEAD_MAX_BLOCKS 2048 // Largest window that can be set per unit
+#define READ_AHEAD_MIN_BLOCKS 16   // Window used when a new stream is detected
+#define READ_AHEAD_TRIGGER    2    // Sequential requests seen before read-ahead starts
+
+#ifndef WRITE_BACK_BLOCKS
+#define WRITE_BACK_BLOCKS 0 // Default limit of dirty blocks held per ATA unit, 0 disables write-back
+#endif
+
+#ifndef WRITE_BACK_ALIGN
+#define WRITE_BACK_ALIGN  1 // Default flush alignment in blocks, e.g. the erase block size of a CF card
+#endif
+
+#define WRITE_BACK_MAX_BLOCKS 4096 // Largest dirty limit that can be set per unit
+#define WRITE_BACK_RUN_BLOCKS 64   // Largest write issued by a flush, also the largest alignment
+#define WRITE_BACK_IDLE_MS    4000 // Flush once no write has been taken for this long, see cache_idle
+
+struct CacheBlock {
+    struct MinNode    node;      // LRU list, most recently used at the head
+    struct CacheBlock *hashNext;
+    ULONG             lba;
+    UBYTE             data[];
+};
+
+struct BlockCache {
+    struct SignalSemaphore sem;  // Held by the IDE task while it works on the cache, see cache_mem_handler
+    struct Interrupt       memHandler;
+    struct MinList         lru;
+    struct CacheBlock      *hash[BLOCK_CACHE_HASH_SIZE];
+    struct ExecBase        *SysBase;
+    ULONG                  maxBlocks;
+    ULONG                  numBlocks;
+    ULONG                  hits;
+    ULONG                  misses;
+    UWORD                  changeCount;
+    UWORD                  blockSize;
+    UWORD                  blockShift;
+    bool                   memHandlerAdded;
+};
+
+struct ReadAhead {
+    UBYTE *buffer;
+    ULONG bufSize;
+    ULONG lba;         // First block held in the buffer
+    ULONG numBlocks;   // Number of valid blocks in the buffer
+    ULONG maxBlocks;   // Largest window, the buffer is allocated to hold this many blocks
+    ULONG window;      // Current window, doubles with each refill up to maxBlocks
+    ULONG nextLba;     // Block that would continue the current stream
+    ULONG hits;        // Blocks served from the buffer
+    ULONG prefetched;  // Blocks read into the buffer
+    UWORD changeCount;
+    UWORD seqCount;    // Sequential requests seen in a row, up to READ_AHEAD_TRIGGER
+};
+
+struct WriteBack {
+    struct Interrupt  memHandler;
+    struct MinList    dirty;     // Dirty blocks sorted by LBA
+    struct CacheBlock *hash[BLOCK_CACHE_HASH_SIZE];
+    struct ExecBase   *SysBase;
+    struct Task       *task;     // IDE task to wake when memory runs low
+    ULONG             sigMask;
+    UBYTE             *bounce;   // Flush buffer of WRITE_BACK_RUN_BLOCKS
+    ULONG             bounceSize;
+    ULONG             maxBlocks;
+    ULONG             numBlocks;
+    ULONG             align;
+    ULONG             absorbed;  // Blocks written into the cache
+    ULONG             written;   // Blocks written to the drive by flushes
+    ULONG             writes;    // WRITE commands issued by flushes
+    UWORD             blockSize;
+    UWORD             blockShift;
+    ULONG             lastWrite; // When the last write was taken, in ms
+    BYTE              error;     // Flush error not yet reported by cache_flush
+    volatile bool     flushPending;
+    bool              memHandlerAdded;
+};
+
+/**
+ * cache_enabled
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @returns true if transfers to the unit need to go through cache_read/cache_write
+*/
+static inline bool cache_enabled(struct IDEUnit *unit) {
+    return (unit->cache != NULL && unit->cache->maxBlocks > 0) || unit->readAhead != NULL || unit->writeBack != NULL;
+}
+
+BYTE cache_set_size(struct IDEUnit *unit, ULONG blocks);
+void cache_free(struct IDEUnit *unit);
+void cache_invalidate(struct IDEUnit *unit);
+BYTE cache_set_readahead(struct IDEUnit *unit, ULONG blocks);
+BYTE cache_set_writeback(struct IDEUnit *unit, ULONG blocks, ULONG align);
+BYTE cache_flush(struct IDEUnit *unit);
+void cache_writeback(struct IDEUnit *unit);
+void cache_idle(struct IDEUnit *unit);
+BYTE cache_read(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit);
+BYTE cache_write(void *buffer, ULONG lba, ULONG count, struct IDEUnit *unit);
+
+#endif
@@ -1,10 +1,18 @@
 #ifndef _BLOCK_COPY_H
 #define _BLOCK_COPY_H
+#include <stdbool.h>
 #pragma GCC optimize ("-fomit-frame-pointer")
+/**
+ * All of these routines transfer a whole DRQ block of (count) 512-byte sectors per call
+ * with the sector loop inside the asm, so the caller only needs to check DRQ once per block.
+ * count must be at least 1.
+ * The atapi_*_words routines at the end take a byte count instead, for DRQ chunks of any even size.
+*/
+
 /**
  * ata_read_long_movem
  * 
- * Fast copy of a 512-byte sector using movem
+ * Fast copy of 512-byte sectors using movem
  * Adapted from the open source at_apollo_device by Frédéric REQUIN
  * https://github.com/fredrequin/at_apollo_device
  * 
@@ -14,48 +22,58 @@
  * 
  * With the src of end-52 the error reg will be harmlessly read instead.
  * 
+ * movem uses every free register so the sector count is kept on the stack
+ * 
  * @param source Pointer to drive data port
  * @param destination Pointer to source buffer
+ * @param count Number of sectors
 */
-static inline void ata_read_long_movem (void *source, void *destination) {
+static inline void ata_read_long_movem (void *source, void *destination, ULONG count) {
 
     asm volatile (
-    "lea.l   460(%0),%0                 \n\t"
+    "1:                                 \n\t"
     "offset = 0                         \n\t"
     ".rep 9                             \n\t"
-    "movem.l (%0),d0-d7/a1-a4/a6        \n\t"
+    "movem.l 460(%2),d0-d7/a1-a4/a6     \n\t"
     "movem.l d0-d7/a1-a4/a6,offset(%1)  \n\t"
     "offset = offset + 52               \n\t"
     ".endr                              \n\t"
-    "movem.l 8(%0),d0-d7/a1-a3          \n\t"
+    "movem.l 468(%2),d0-d7/a1-a3        \n\t"
     "movem.l d0-d7/a1-a3,offset(%1)     \n\t"
-    :
-    :"a" (source),"a" (destination)
-    :"a1","a2","a3","a4","a6","d0","d1","d2","d3","d4","d5","d6","d7"
+    "lea.l   512(%1),%1                 \n\t"
+    "subq.l  #1,%0                      \n\t"
+    "bne     1b                         \n\t"
+    :"+m" (count), "+a" (destination)
+    :"a" (source)
+    :"a1","a2","a3","a4","a6","d0","d1","d2","d3","d4","d5","d6","d7","memory"
     );
 }
 
 /**
  * ata_write_long_movem
  * 
- * Fast copy of a 512-byte sector using movem
+ * Fast copy of 512-byte sectors using movem
  * Adapted from the open source at_apollo_device by Frédéric REQUIN
  * https://github.com/fredrequin/at_apollo_device
  * 
  * @param source Pointer to source buffer
  * @param destination Pointer to drive data port
+ * @param count Number of sectors
 */
-static inline void ata_write_long_movem (void *source, void *destination) {
+static inline void ata_write_long_movem (void *source, void *destination, ULONG count) {
 
     asm volatile (
+    "1:                           \n\t"
     ".rep 9                       \n\t"
-    "movem.l (%0)+,d0-d7/a1-a4/a6 \n\t"
-    "movem.l d0-d7/a1-a4/a6,(%1)  \n\t"
+    "movem.l (%1)+,d0-d7/a1-a4/a6 \n\t"
+    "movem.l d0-d7/a1-a4/a6,(%2)  \n\t"
     ".endr                        \n\t"
-    "movem.l (%0)+,d0-d7/a1-a3    \n\t"
-    "movem.l d0-d7/a1-a3,(%1)     \n\t"
-    :
-    :"a" (source),"a" (destination)
+    "movem.l (%1)+,d0-d7/a1-a3    \n\t"
+    "movem.l d0-d7/a1-a3,(%2)     \n\t"
+    "subq.l  #1,%0                \n\t"
+    "bne     1b                   \n\t"
+    :"+m" (count), "+a" (source)
+    :"a" (destination)
     :"a1","a2","a3","a4","a6","d0","d1","d2","d3","d4","d5","d6","d7"
     );
 }
@@ -63,42 +81,333 @@ static inline void ata_write_long_movem (void *source, void *destination) {
 /**
  * ata_read_long_move
  * 
- * Read a sector using move - faster than movem on 68020+
+ * Read sectors using move - faster than movem on 68020+
  * 
+ * @param source Pointer to drive data port
+ * @param destination Pointer to destination buffer
+ * @param count Number of sectors
 */
-static inline void ata_read_long_move (void *source, void *destination) {
+static inline void ata_read_long_move (void *source, void *destination, ULONG count) {
     asm volatile (
-        "move.l #3,d0           \n\t"
-        ".l1:                   \n\t"
+        "lsl.l  #2,%0           \n\t"
+        "subq.l #1,%0           \n\t"
+        "1:                     \n\t"
         ".rept  32              \n\t"
-        "move.l (%0),(%1)+      \n\t"
+        "move.l (%2),(%1)+      \n\t"
         ".endr                  \n\t"
-        "dbra   d0,.l1"
-    :
-    :"a" (source), "a" (destination)
-    :"d0"
+        "dbra   %0,1b"
+    :"+d" (count), "+a" (destination)
+    :"a" (source)
+    :"memory"
     );
 }
 
 /**
  * ata_write_long_move
  * 
- * Write a sector using move - faster than movem on 68020+
+ * Write sectors using move - faster than movem on 68020+
  * 
+ * @param source Pointer to source buffer
+ * @param destination Pointer to drive data port
+ * @param count Number of sectors
 */
-static inline void ata_write_long_move (void *source, void *destination) {
+static inline void ata_write_long_move (void *source, void *destination, ULONG count) {
     asm volatile (
-        "moveq.l #3,d0          \n\t"
-        ".l2:                   \n\t"
+        "lsl.l  #2,%0           \n\t"
+        "subq.l #1,%0           \n\t"
+        "1:                     \n\t"
         ".rept  32              \n\t"
-        "move.l (%0)+,(%1)      \n\t"
+        "move.l (%1)+,(%2)      \n\t"
+        ".endr                  \n\t"
+        "dbra   %0,1b"
+    :"+d" (count), "+a" (source)
+    :"a" (destination)
+    );
+}
+
+/**
+ * ata_read_long_move020
+ * 
+ * Read sectors on the 68020/68030 a 16-byte line at a time
+ * 
+ * Each step reads four longwords from the data port with one movem.l, the port is mirrored so the
+ * ascending addresses all hit it, and stores them to the buffer with one movem.l.
+ * The stores of a line then go out back to back rather than between port reads,
+ * and the 96 byte loop stays in the 256 byte instruction cache.
+ * It is not assumed to be faster than move or movem on every board, ata_bench_xfer measures it.
+ * 
+ * @param source Pointer to drive data port
+ * @param destination Pointer to destination buffer
+ * @param count Number of sectors
+*/
+static inline void ata_read_long_move020 (void *source, void *destination, ULONG count) {
+    asm volatile (
+        "lsl.l  #2,%0           \n\t"
+        "subq.l #1,%0           \n\t"
+        "1:                     \n\t"
+        ".rept  8               \n\t"
+        "movem.l (%2),d1-d4     \n\t"
+        "movem.l d1-d4,(%1)     \n\t"
+        "lea.l  16(%1),%1       \n\t"
+        ".endr                  \n\t"
+        "dbra   %0,1b"
+    :"+d" (count), "+a" (destination)
+    :"a" (source)
+    :"d1","d2","d3","d4","memory"
+    );
+}
+
+/**
+ * ata_write_long_move020
+ * 
+ * Write sectors on the 68020/68030 a 16-byte line at a time
+ * 
+ * Each line of the buffer is loaded with one movem.l, with data burst enabled on a 68030 that is a single burst fill,
+ * and written to the mirrored data port with one movem.l.
+ * 
+ * @param source Pointer to source buffer
+ * @param destination Pointer to drive data port
+ * @param count Number of sectors
+*/
+static inline void ata_write_long_move020 (void *source, void *destination, ULONG count) {
+    asm volatile (
+        "lsl.l  #2,%0           \n\t"
+        "subq.l #1,%0           \n\t"
+        "1:                     \n\t"
+        ".rept  8               \n\t"
+        "movem.l (%1)+,d1-d4    \n\t"
+        "movem.l d1-d4,(%2)     \n\t"
+        ".endr                  \n\t"
+        "dbra   %0,1b"
+    :"+d" (count), "+a" (source)
+    :"a" (destination)
+    :"d1","d2","d3","d4"
+    );
+}
+
+#define MOVE16_MIN_ADDR 0x01000000 // Chip RAM and the Zorro II space can't take line transfers
+#define MOVE16_MAX_ADDR 0x10000000 // The Zorro III space starts here, line transfers to boards there are unreliable
+
+/**
+ * move16_ok
+ * 
+ * Check that a buffer is line-aligned and in CPU-local fast RAM, the motherboard or CPU slot memory of an A3000/A4000
+ * or accelerator memory mapped below the Zorro III space. Memory anywhere else takes the move.l path.
+ * 
+ * @param addr Start of the buffer
+ * @param bytes Length of the buffer
+ * @returns true if MOVE16 can be used on the buffer
+*/
+static inline bool move16_ok(void *addr, ULONG bytes) {
+    return (((ULONG)addr & 15) == 0 && (ULONG)addr >= MOVE16_MIN_ADDR &&
+            (ULONG)addr < MOVE16_MAX_ADDR && bytes <= MOVE16_MAX_ADDR - (ULONG)addr);
+}
+
+/**
+ * ata_read_long_move16
+ * 
+ * Read sectors on the 68040/68060 using MOVE16
+ * 
+ * Four longwords are read from the data port into registers and stored to a line buffer on the stack,
+ * which MOVE16 then bursts out to the destination as a whole 16-byte line.
+ * This avoids the line fill that a copyback write miss would otherwise cost for every line of the buffer.
+ * 
+ * MOVE16 reads the line buffer as well, and this can run on the caller's stack through ide_quick_io,
+ * so both it and the destination must pass move16_ok or this falls back to move.l
+ * 
+ * @param source Pointer to drive data port
+ * @param destination Pointer to destination buffer
+ * @param count Number of sectors
+*/
+static inline void ata_read_long_move16 (void *source, void *destination, ULONG count) {
+    ULONG bounce[8];
+
+    register void *src  asm("a0") = source;
+    register void *dest asm("a1") = destination;
+    register void *line asm("a2") = (void *)(((ULONG)bounce + 15) & ~15);
+
+    if (move16_ok(destination,count << 9) && move16_ok(line,16)) {
+        asm volatile (
+            "lsl.l  #3,%0           \n\t"
+            "subq.l #1,%0           \n\t"
+            "1:                     \n\t"
+            ".rept  4               \n\t"
+            "movem.l (%3),d0-d3     \n\t"
+            "movem.l d0-d3,(%2)     \n\t"
+            ".word  0xF622,0x9000   \n\t" // move16 (a2)+,(a1)+
+            "lea.l  -16(%2),%2      \n\t"
+            ".endr                  \n\t"
+            "dbra   %0,1b"
+        :"+d" (count), "+a" (dest), "+a" (line)
+        :"a" (src)
+        :"d0","d1","d2","d3","memory"
+        );
+    } else {
+        asm volatile (
+            "lsl.l  #2,%0           \n\t"
+            "subq.l #1,%0           \n\t"
+            "1:                     \n\t"
+            ".rept  32              \n\t"
+            "move.l (%2),(%1)+      \n\t"
+            ".endr                  \n\t"
+            "dbra   %0,1b"
+        :"+d" (count), "+a" (dest)
+        :"a" (src)
+        :"memory"
+        );
+    }
+}
+
+/**
+ * ata_read_unaligned_merge
+ * 
+ * Read sectors to an odd-aligned buffer
+ * 
+ * The first byte is stored on its own so that the rest of the buffer can be written with aligned move.l
+ * Each longword from the drive is rotated left by 8 and its top byte merged into the low byte of the previous one.
+ * All longword accesses are to even addresses so this works on the 68000 as well as 68020+
+ * 
+ * @param source Pointer to drive data port
+ * @param destination Pointer to destination buffer
+ * @param count Number of sectors
+*/
+static inline void ata_read_unaligned_merge (void *source, void *destination, ULONG count) {
+    asm volatile (
+        "lsl.l  #7,%0           \n\t" // Longwords to transfer
+        "subq.l #2,%0           \n\t" // Less the first, less one for dbra
+        "move.l (%2),d0         \n\t" // d0 = b0 b1 b2 b3
+        "rol.l  #8,d0           \n\t" // d0 = b1 b2 b3 b0
+        "move.b d0,(%1)+        \n\t" // Write b0, destination is now even
+        "1:                     \n\t"
+        "move.l (%2),d1         \n\t" // d1 = c0 c1 c2 c3
+        "rol.l  #8,d1           \n\t" // d1 = c1 c2 c3 c0
+        "move.b d1,d0           \n\t" // d0 = b1 b2 b3 c0
+        "move.l d0,(%1)+        \n\t"
+        "move.l d1,d0           \n\t"
+        "dbra   %0,1b           \n\t"
+        "swap   d0              \n\t" // d0 = c3 c0 c1 c2
+        "move.w d0,(%1)+        \n\t" // Write c1 c2
+        "swap   d0              \n\t"
+        "lsr.w  #8,d0           \n\t"
+        "move.b d0,(%1)         \n\t" // Write c3
+    :"+d" (count), "+a" (destination)
+    :"a" (source)
+    :"d0","d1","memory"
+    );
+}
+
+/**
+ * ata_write_unaligned_merge
+ * 
+ * Write sectors from an odd-aligned buffer
+ * 
+ * After the first byte the buffer is read with aligned move.l,
+ * the previous trailing byte is merged into each longword with a rotate before it is written to the drive.
+ * 
+ * @param source Pointer to source buffer
+ * @param destination Pointer to drive data port
+ * @param count Number of sectors
+*/
+static inline void ata_write_unaligned_merge (void *source, void *destination, ULONG count) {
+    asm volatile (
+        "lsl.l  #7,%0           \n\t" // Longwords to transfer
+        "subq.l #2,%0           \n\t" // Less the last, less one for dbra
+        "move.b (%1)+,d0        \n\t" // d0.b = s0, source is now even
+        "1:                     \n\t"
+        "move.l (%1)+,d1        \n\t" // d1 = s1 s2 s3 s4
+        "move.b d1,d2           \n\t" // Keep s4 for the next longword
+        "move.b d0,d1           \n\t" // d1 = s1 s2 s3 s0
+        "ror.l  #8,d1           \n\t" // d1 = s0 s1 s2 s3
+        "move.l d1,(%2)         \n\t"
+        "move.b d2,d0           \n\t"
+        "dbra   %0,1b           \n\t"
+        ".rept  3               \n\t" // Last longword from the final 3 bytes
+        "lsl.l  #8,d0           \n\t"
+        "move.b (%1)+,d0        \n\t"
+        ".endr                  \n\t"
+        "move.l d0,(%2)         \n\t"
+    :"+d" (count), "+a" (source)
+    :"a" (destination)
+    :"d0","d1","d2"
+    );
+}
+
+/**
+ * atapi_read_words
+ * 
+ * Read a DRQ chunk that isn't a whole number of 512-byte sectors e.g. the tail of a 2352-byte CD-DA frame
+ * Longwords are moved eight at a time, then one at a time, then the last word if the length isn't a multiple of 4
+ * 
+ * @param source Pointer to drive data port
+ * @param destination Pointer to destination buffer
+ * @param bytes Number of bytes, must be even and less than 65536
+*/
+static inline void atapi_read_words (void *source, void *destination, ULONG bytes) {
+    asm volatile (
+        "move.l %1,d0           \n\t"
+        "lsr.l  #5,d0           \n\t" // 32-byte blocks
+        "bra.s  2f              \n\t"
+        "1:                     \n\t"
+        ".rept  8               \n\t"
+        "move.l (%2),(%0)+      \n\t"
+        ".endr                  \n\t"
+        "2:                     \n\t"
+        "dbra   d0,1b           \n\t"
+        "move.l %1,d0           \n\t"
+        "lsr.w  #2,d0           \n\t"
+        "and.w  #7,d0           \n\t" // Longwords left over
+        "bra.s  4f              \n\t"
+        "3:                     \n\t"
+        "move.l (%2),(%0)+      \n\t"
+        "4:                     \n\t"
+        "dbra   d0,3b           \n\t"
+        "btst   #1,%1           \n\t"
+        "beq.s  5f              \n\t"
+        "move.w (%2),(%0)+      \n\t"
+        "5:                     \n\t"
+    :"+a" (destination)
+    :"d" (bytes), "a" (source)
+    :"d0","cc","memory"
+    );
+}
+
+/**
+ * atapi_write_words
+ * 
+ * Write a DRQ chunk that isn't a whole number of 512-byte sectors
+ * 
+ * @param source Pointer to source buffer
+ * @param destination Pointer to drive data port
+ * @param bytes Number of bytes, must be even and less than 65536
+*/
+static inline void atapi_write_words (void *source, void *destination, ULONG bytes) {
+    asm volatile (
+        "move.l %1,d0           \n\t"
+        "lsr.l  #5,d0           \n\t"
+        "bra.s  2f              \n\t"
+        "1:                     \n\t"
+        ".rept  8               \n\t"
+        "move.l (%0)+,(%2)      \n\t"
         ".endr                  \n\t"
-        "dbra   d0,.l2"
-    :
-    :"a" (source), "a" (destination)
-    :"d0"
+        "2:                     \n\t"
+        "dbra   d0,1b           \n\t"
+        "move.l %1,d0           \n\t"
+        "lsr.w  #2,d0           \n\t"
+        "and.w  #7,d0           \n\t"
+        "bra.s  4f              \n\t"
+        "3:                     \n\t"
+        "move.l (%0)+,(%2)      \n\t"
+        "4:                     \n\t"
+        "dbra   d0,3b           \n\t"
+        "btst   #1,%1           \n\t"
+        "beq.s  5f              \n\t"
+        "move.w (%0)+,(%2)      \n\t"
+        "5:                     \n\t"
+    :"+a" (source)
+    :"d" (bytes), "a" (destination)
+    :"d0","cc"
     );
 }
 
 #pragma GCC reset_options
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#include <devices/scsidisk.h>
+#include <devices/trackdisk.h>
+#include <exec/errors.h>
+#include <exec/execbase.h>
+#include <exec/memory.h>
+#include <proto/exec.h>
+#include <stdbool.h>
+
+#include "debug.h"
+#include "device.h"
+#include "ata.h"
+#include "atapi.h"
+#include "scsi.h"
+#include "cdcache.h"
+
+/**
+ * cd_cache_empty
+ *
+ * Mark every segment as unused
+ *
+ * @param cache Pointer to a CDCache struct
+*/
+static void cd_cache_empty(struct CDCache *cache) {
+    for (int i = 0; i < cache->numSegments; i++) {
+        cache->segments[i].numBlocks = 0;
+    }
+}
+
+/**
+ * cd_cache_load_toc
+ *
+ * Read the TOC and convert the start of each track to an LBA
+ * If the TOC can't be read prefetches are only bounded by the end of the medium
+ *
+ * @param cache Pointer to a CDCache struct
+ * @param unit Pointer to an IDEUnit struct
+*/
+static void cd_cache_load_toc(struct CDCache *cache, struct IDEUnit *unit) {
+    struct ExecBase *SysBase = unit->SysBase;
+    struct SCSI_CD_TOC *toc;
+    struct SCSI_TOC_TRACK_DESCRIPTOR *td;
+    ULONG numTracks;
+
+    cache->numTracks = 0;
+    cache->tocValid  = true; // Don't try again until the next media change
+
+    if ((toc = AllocMem(SCSI_TOC_SIZE,MEMF_ANY|MEMF_CLEAR)) == NULL) return;
+
+    if (atapi_read_toc(unit,(BYTE *)toc,SCSI_TOC_SIZE) == 0 && toc->lastTrack >= toc->firstTrack) {
+        numTracks = (toc->lastTrack - toc->firstTrack) + 1;
+        if (numTracks >= CD_CACHE_TRACKS) numTracks = CD_CACHE_TRACKS - 1;
+
+        // numTracks descriptors followed by the lead-out
+        for (int t = 0; t <= numTracks; t++) {
+            td = &toc->td[t];
+            cache->trackStart[t] = ((td->minute * 60 + td->second) * 75 + td->frame) - 150;
+        }
+
+        cache->numTracks = numTracks;
+    } else {
+        Warn("CD cache: unit %ld: TOC unavailable\n",unit->unitNum);
+    }
+
+    FreeMem(toc,SCSI_TOC_SIZE);
+}
+
+/**
+ * cd_cache_track_end
+ *
+ * @param cache Pointer to a CDCache struct
+ * @param unit Pointer to an IDEUnit struct
+ * @param lba Block address
+ * @returns First block after the track that holds lba
+*/
+static ULONG cd_cache_track_end(struct CDCache *cache, struct IDEUnit *unit, ULONG lba) {
+    ULONG end = unit->logicalSectors;
+
+    for (int t = 1; t <= cache->numTracks; t++) {
+        if (lba < cache->trackStart[t]) {
+            if (cache->trackStart[t] < end) end = cache->trackStart[t];
+            break;
+        }
+    }
+
+    return end;
+}
+
+/**
+ * cd_cache_find
+ *
+ * @param cache Pointer to a CDCache struct
+ * @param lba Block address
+ * @returns Pointer to the segment holding lba or NULL if it isn't cached
+*/
+static struct CDSegment *cd_cache_find(struct CDCache *cache, ULONG lba) {
+    struct CDSegment *seg;
+
+    for (seg = (struct CDSegment *)cache->lru.mlh_Head;
+         seg->node.mln_Succ != NULL;
+         seg = (struct CDSegment *)seg->node.mln_Succ) {
+        if (seg->numBlocks > 0 && lba >= seg->lba && lba < seg->lba + seg->numBlocks) return seg;
+    }
+
+    return NULL;
+}
+
+/**
+ * cd_cache_set_size
+ *
+ * Set the number of prefetch segments cached for an ATAPI unit
+ * Setting the size to 0 frees the cache
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param segments Number of segments
+ * @returns non-zero on error
+*/
+BYTE cd_cache_set_size(struct IDEUnit *unit, ULONG segments) {
+    struct ExecBase *SysBase = unit->SysBase;
+    struct CDCache *cache;
+
+    if (segments > CD_CACHE_MAX_SEGMENTS) return IOERR_BADLENGTH;
+
+    cd_cache_free(unit);
+
+    if (segments == 0) return 0;
+
+    if ((cache = AllocMem(sizeof(struct CDCache),MEMF_ANY|MEMF_CLEAR)) == NULL) return TDERR_NoMem;
+
+    if ((cache->segments = AllocMem(sizeof(struct CDSegment) * segments,MEMF_ANY|MEMF_CLEAR)) == NULL) {
+        FreeMem(cache,sizeof(struct CDCache));
+        return TDERR_NoMem;
+    }
+
+    cache->lru.mlh_Tail     = NULL;
+    cache->lru.mlh_Head     = (struct MinNode *)&cache->lru.mlh_Tail;
+    cache->lru.mlh_TailPred = (struct MinNode *)&cache->lru;
+
+    cache->numSegments = segments;
+    cache->changeCount = unit->changeCount;
+    unit->cdCache      = cache;
+
+    for (int i = 0; i < segments; i++) {
+        if ((cache->segments[i].data = AllocMem(CD_CACHE_SEGMENT_SIZE,MEMF_ANY)) == NULL) {
+            cd_cache_free(unit);
+            return TDERR_NoMem;
+        }
+        AddTail((struct List *)&cache->lru,(struct Node *)&cache->segments[i]);
+    }
+
+    Info("CD cache: unit %ld: %ld segments\n",unit->unitNum,segments);
+
+    return 0;
+}
+
+/**
+ * cd_cache_free
+ *
+ * Free the CD cache of a unit
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cd_cache_free(struct IDEUnit *unit) {
+    struct ExecBase *SysBase = unit->SysBase;
+    struct CDCache *cache = unit->cdCache;
+
+    if (cache == NULL) return;
+
+    for (int i = 0; i < cache->numSegments; i++) {
+        if (cache->segments[i].data) FreeMem(cache->segments[i].data,CD_CACHE_SEGMENT_SIZE);
+    }
+
+    FreeMem(cache->segments,sizeof(struct CDSegment) * cache->numSegments);
+    FreeMem(cache,sizeof(struct CDCache));
+    unit->cdCache = NULL;
+}
+
+/**
+ * cd_cache_invalidate
+ *
+ * Throw away all cached segments of a unit
+ * Used when the medium may have been written behind the cache e.g. by a SCSI-direct command
+ *
+ * @param unit Pointer to an IDEUnit struct
+*/
+void cd_cache_invalidate(struct IDEUnit *unit) {
+    if (unit->cdCache) cd_cache_empty(unit->cdCache);
+}
+
+/**
+ * cd_cache_discard
+ *
+ * Throw away any segments that overlap a range of blocks that has been written
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param lba First block
+ * @param count Number of blocks
+*/
+void cd_cache_discard(struct IDEUnit *unit, ULONG lba, ULONG count) {
+    struct CDCache *cache = unit->cdCache;
+    struct CDSegment *seg;
+
+    if (cache == NULL) return;
+
+    for (int i = 0; i < cache->numSegments; i++) {
+        seg = &cache->segments[i];
+        if (seg->numBlocks > 0 && lba < seg->lba + seg->numBlocks && seg->lba < lba + count) {
+            seg->numBlocks = 0;
+        }
+    }
+}
+
+/**
+ * cd_cache_read
+ *
+ * Read blocks from an ATAPI unit through the CD cache
+ *
+ * A miss reads a whole segment starting at the first missing block, cut short at the end of its track
+ * so that the prefetch never runs into the next track (e.g. the audio tracks of a mixed-mode CD) or the lead-out.
+ * If the prefetch fails just the requested blocks are read so that the error is reported for those.
+ *
+ * Requests larger than a segment, or without a cache, go straight to the drive
+ *
+ * @param buffer Destination buffer
+ * @param lba First block
+ * @param count Number of blocks
+ * @param actual Pointer to io_Actual
+ * @param unit Pointer to an IDEUnit struct
+ * @returns non-zero on error
+*/
+BYTE cd_cache_read(void *buffer, ULONG lba, ULONG count, ULONG *actual, struct IDEUnit *unit) {
+    struct ExecBase *SysBase = unit->SysBase;
+    struct CDCache *cache = unit->cdCache;
+    struct CDSegment *seg;
+    ULONG blockShift = unit->blockShift;
+    ULONG segBlocks  = CD_CACHE_SEGMENT_SIZE >> blockShift;
+    ULONG done = 0;
+    ULONG next, end, take, ignored;
+    BYTE error = 0;
+
+    if (cache == NULL || cache->numSegments == 0 || blockShift == 0 || count > segBlocks) {
+        return atapi_translate(buffer,lba,count,actual,unit,READ);
+    }
+
+    if (cache->changeCount != unit->changeCount) {
+        cd_cache_empty(cache);
+        cache->tocValid    = false;
+        cache->changeCount = unit->changeCount;
+    }
+
+    if (!cache->tocValid) cd_cache_load_toc(cache,unit);
+
+    while (done < count) {
+        next = lba + done;
+
+        if ((seg = cd_cache_find(cache,next)) != NULL) {
+            take = seg->lba + seg->numBlocks - next;
+            if (take > count - done) take = count - done;
+            cache->hits += take;
+        } else {
+            end = cd_cache_track_end(cache,unit,next);
+            if (end <= next) end = next + (count - done);
+            if (end - next > segBlocks) end = next + segBlocks;
+
+            seg = (struct CDSegment *)cache->lru.mlh_TailPred;
+            seg->numBlocks = 0;
+
+            if ((error = atapi_translate(seg->data,next,end - next,&ignored,unit,READ)) != 0) {
+                if (error != TDERR_DiskChanged && error != IOERR_UNITBUSY) {
+                    error = atapi_translate((UBYTE *)buffer + (done << blockShift),next,count - done,&ignored,unit,READ);
+                    if (error == 0) done = count;
+                }
+                break;
+            }
+
+            seg->lba       = next;
+            seg->numBlocks = end - next;
+            cache->prefetched += seg->numBlocks;
+
+            take = seg->numBlocks;
+            if (take > count - done) take = count - done;
+            cache->misses += take;
+        }
+
+        Remove((struct Node *)seg);
+        AddHead((struct List *)&cache->lru,(struct Node *)seg);
+
+        CopyMem(seg->data + ((next - seg->lba) << blockShift),(UBYTE *)buffer + (done << blockShift),take << blockShift);
+        done += take;
+    }
+
+    *actual = done << blockShift;
+
+    return error;
+}
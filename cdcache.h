@@ -0,0 +1,47 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#ifndef _CDCACHE_H
+#define _CDCACHE_H
+
+#include <exec/lists.h>
+#include <exec/types.h>
+#include <stdbool.h>
+#include "device.h"
+
+#ifndef CD_CACHE_SEGMENTS
+#define CD_CACHE_SEGMENTS 0 // Default number of cache segments per ATAPI unit, 0 disables the CD cache
+#endif
+
+#define CD_CACHE_MAX_SEGMENTS 64       // Largest number of segments that can be set per unit
+#define CD_CACHE_SEGMENT_SIZE (64*1024) // Bytes read by each prefetch, 32 sectors of 2048 bytes
+#define CD_CACHE_TRACKS       100       // Track starts kept from the TOC including the lead-out
+
+struct CDSegment {
+    struct MinNode node;      // LRU list, most recently used at the head
+    ULONG          lba;
+    ULONG          numBlocks; // Number of valid blocks, 0 if the segment is unused
+    UBYTE          *data;
+};
+
+struct CDCache {
+    struct MinList   lru;
+    struct CDSegment *segments;
+    ULONG            numSegments;
+    ULONG            trackStart[CD_CACHE_TRACKS]; // Start of each track from the TOC, then the lead-out
+    ULONG            hits;       // Blocks served from the cache
+    ULONG            misses;     // Blocks that had to be read from the drive
+    ULONG            prefetched; // Blocks read into the cache
+    UWORD            numTracks;  // 0 if the TOC couldn't be read, prefetches then only stop at the end of the medium
+    UWORD            changeCount;
+    bool             tocValid;
+};
+
+BYTE cd_cache_set_size(struct IDEUnit *unit, ULONG segments);
+void cd_cache_free(struct IDEUnit *unit);
+void cd_cache_invalidate(struct IDEUnit *unit);
+void cd_cache_discard(struct IDEUnit *unit, ULONG lba, ULONG count);
+BYTE cd_cache_read(void *buffer, ULONG lba, ULONG count, ULONG *actual, struct IDEUnit *unit);
+
+#endif
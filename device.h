@@ -5,8 +5,10 @@
 #ifndef _DEVICE_H
 #define _DEVICE_H
 #include <dos/filehandler.h>
+#include <exec/interrupts.h>
 #include <exec/semaphores.h>
 #include <stdbool.h>
+#include "extents.h"
 #define OAHR_MANUF_ID 5194
 #define BSC_MANUF_ID  2092
 #define A1K_MANUF_ID  2588
@@ -15,9 +17,20 @@
 
 #define MAX_UNITS 4
 
+#define UNIT_TABLE_SIZE 10         // open() reads the tens digit of the unit number as a LUN, so units 0-9 can be opened
+#define UNIT_COOKIE     0x4C494445 // 'LIDE', XORed with the unit address to tell live units apart from stale pointers
+
 enum xfer {
     longword_movem,
-    longword_move
+    longword_move,
+    longword_move020,
+    longword_move16,
+    xfer_methods     // Number of transfer methods, must be last
+};
+
+struct ATAExtent {
+    UBYTE *buffer;
+    ULONG count;    // Blocks
 };
 
 /**
@@ -40,16 +53,17 @@ struct Drive {
 struct IDEUnit {
     struct MinNode mn_Node;
     struct Unit io_unit;
+    ULONG cookie;                  // UNIT_COOKIE ^ address while the unit is in the unit table, see ioreq_is_valid
     struct ConfigDev *cd;
     struct ExecBase *SysBase;
     struct IDETask *itask;
     volatile struct Drive *drive;
-    BYTE  (*write_taskfile)(struct IDEUnit *, UBYTE, ULONG, UBYTE, UBYTE);
+    BYTE  (*write_taskfile)(struct IDEUnit *, UBYTE, ULONG, UWORD, UBYTE);
     enum  xfer xferMethod;
-    void  (*read_fast)(void *, void *);
-    void  (*write_fast)(void *, void *);
-    void  (*read_unaligned)(void *, void *);
-    void  (*write_unaligned)(void *, void *);
+    void  (*read_fast)(void *, void *, ULONG);
+    void  (*write_fast)(void *, void *, ULONG);
+    void  (*read_unaligned)(void *, void *, ULONG);
+    void  (*write_unaligned)(void *, void *, ULONG);
     volatile UBYTE *shadowDevHead;
     volatile void  *changeInt;
     volatile bool  deferTUR;
@@ -65,6 +79,18 @@ struct IDEUnit {
     bool  xferMultiple;
     bool  lba;
     bool  lba48;
+    bool  writeCacheSupported;
+    bool  writeCache;
+    bool  flushExt;
+    bool  lookAhead;
+    bool  nonRotational; // IDENTIFY word 217 says this is solid state media
+    bool  elevator;      // Serve transfers in C-SCAN order, see sched_next
+    bool  becomingReady; // ATAPI unit reported it is spinning up, see atapi_test_unit_ready
+    bool  gesn;          // Poll the ATAPI unit with GET EVENT STATUS NOTIFICATION, see atapi_check_media
+    bool  overlapSupported; // ATAPI unit supports overlapped PACKET commands
+    bool  overlap;          // Let the unit release the channel during PACKET commands, see atapi_overlap_release
+    UBYTE apmLevel;  // Current APM level, 0 if disabled or not supported
+    UBYTE aamLevel;  // Current AAM level, 0 if disabled or not supported
     UWORD openCount;
     UWORD changeCount;
     UWORD heads;
@@ -73,8 +99,22 @@ struct IDEUnit {
     UWORD blockShift;
     ULONG cylinders;
     ULONG logicalSectors;
+    ULONG maxTransfer; // Max sectors per READ/WRITE command
     struct MinList changeInts;
     UBYTE multipleCount;
+    ULONG xferSpeed[xfer_methods]; // Measured read speed of each transfer method in KB/s, 0 if not measured
+    ULONG xferSpeedUnaligned;      // Measured read speed to an odd-aligned buffer in KB/s
+    ULONG waitLast;                // Duration of the last status wait in microseconds
+    ULONG waitMax;                 // Longest status wait seen in microseconds
+    struct BlockCache *cache;      // Block cache, NULL if not enabled
+    struct ReadAhead  *readAhead;  // Read-ahead buffer, NULL if not enabled
+    struct WriteBack  *writeBack;  // Write-back cache, NULL if not enabled
+    struct CDCache    *cdCache;    // CD sector cache of an ATAPI unit, NULL if not enabled
+    ULONG headLba;                 // Block after the last transfer scheduled, see sched_next
+    ULONG readySince;              // When the unit was first seen becoming ready, in ms
+    ULONG readyPoll;               // Earliest time to check it again while it is becoming ready, in ms
+    volatile UWORD outstanding;    // Requests taken by the IDE task and not yet replied, see sched_done
+    UBYTE pollSkips;               // Consecutive change polls skipped because the unit had requests outstanding
 };
 
 struct DeviceBase {
@@ -88,7 +128,8 @@ struct DeviceBase {
     ULONG                  highestUnit;
     UBYTE                  numTasks;
     struct MinList         units;
-    struct SignalSemaphore ulSem;
+    struct SignalSemaphore ulSem;  // Held while units are added to or removed from units and unitTable
+    struct IDEUnit         *unitTable[UNIT_TABLE_SIZE]; // Indexed by unit number, NULL if there is no unit
     struct MinList         ideTasks;
 };
 
@@ -101,8 +142,43 @@ struct IDETask {
     struct MsgPort     *iomp;
     struct MsgPort     *timermp;
     struct timerequest *tr;
+    struct Interrupt   irqServer;
+    volatile UBYTE     *statusReg;
+    ULONG              pollsPerMs;
+    ULONG              eclockPerMs;
+    ULONG              irqMask;
+    volatile bool      irqWait;
+    bool               irqEnabled;
+    BYTE               irqSig;
     volatile bool      active;
     UBYTE              shadowDevHead;
+    UBYTE              shadowTaskFile[5]; // Last values written to Features - LBA High, see ata_tf_write
+    UBYTE              shadowValid;       // Bitmask of shadowTaskFile entries known to match the drive
+    ULONG              tfWrites;          // Taskfile register writes that went out on the bus
+    ULONG              tfSkipped;         // Taskfile register writes skipped because the shadow matched
+    struct MinList     queue;             // Requests taken from iomp waiting to be served, see sched_next
+    struct MinList     parked;            // Transfers held while their ATAPI unit spins up, see sched_park
+    struct SignalSemaphore busSem;        // Held while the channel is in use, by the IDE task or by ide_quick_io
+    ULONG              quick;             // Requests served in the caller's context by ide_quick_io
+    UWORD              bypass;            // Times the oldest queued request has been passed over
+    ULONG              merged;            // Requests served as part of another request's transfer
+    ULONG              preempted;         // Requests served between the slices of a longer transfer
+    ULONG              burstUs;           // CPU burst budget in microseconds, 0 if transfers never yield
+    ULONG              burstBudget;       // The budget in EClock ticks, or in blocks without the EClock
+    ULONG              burstStart;        // EClock at the start of the current burst
+    ULONG              burstBlocks;       // Blocks transferred in the current burst without the EClock
+    ULONG              yields;            // Times a transfer gave up the CPU
+    ULONG              releases;          // Times an ATAPI unit released the channel during a command
+    ULONG              overlapped;        // Requests served while an ATAPI unit had released the channel
+    bool               slicing;           // A sliced transfer is in progress, see transfer_sliced
+    struct Interrupt   resetHandler;      // Flushes the write-back caches on Ctrl-Amiga-Amiga, see ide_reset_handler
+    struct MsgPort     *kbdmp;
+    struct IOStdReq    *kbdReq;           // keyboard.device request, NULL if the reset handler isn't installed
+    volatile bool      resetting;         // Set by the reset handler, from then on writes go straight to the drive
+    bool               resetFlushed;      // The write-back caches have been flushed for the reset
+    struct ATAExtent   extRun[EXTENTS_MAX];   // Scratch space of transfer_extents, kept off the task's stack
+    ULONG              extLba[EXTENTS_MAX];
+    UBYTE              extOrder[EXTENTS_MAX];
     UBYTE              boardNum;
     UBYTE              taskNum;
     UBYTE              channel;
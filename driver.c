@@ -19,8 +19,10 @@
 #include "ata.h"
 #include "atapi.h"
 #include "device.h"
+#include "extents.h"
 #include "idetask.h"
 #include "newstyle.h"
+#include "sched.h"
 #include "td64.h"
 #include "mounter.h"
 #include "debug.h"
@@ -189,31 +191,27 @@ static BOOL FindCDFS() {
 }
 #endif
 
+/**
+ * ioreq_is_valid
+ *
+ * Check that an IORequest belongs to this device and points to a live unit
+ * Units are looked up in the unit table by number, so this needs no lock and no list walk
+ *
+ * @param dev Pointer to DeviceBase
+ * @param ior Pointer to the IORequest
+ * @returns true if the request is valid
+*/
 static bool ioreq_is_valid(struct DeviceBase *dev, struct IORequest *ior) {
-    bool found = false;
-
-    struct IDEUnit *unit;
-
-    if (SysBase->SoftVer >= 36) {
-        ObtainSemaphoreShared(&dev->ulSem);
-    } else {
-        ObtainSemaphore(&dev->ulSem);
-    }
+    struct IDEUnit *unit = (struct IDEUnit *)ior->io_Unit;
 
-    for (unit = (struct IDEUnit *)dev->units.mlh_Head;
-         unit->mn_Node.mln_Succ != NULL;
-         unit = (struct IDEUnit *)unit->mn_Node.mln_Succ) {
-            if (unit == (struct IDEUnit *)ior->io_Unit) {
-                found = true;
-                break;
-            }
-         }
+    if ((struct Device *)dev != ior->io_Device) return false;
 
-    ReleaseSemaphore(&dev->ulSem);
+    // Check alignment first so that a bad pointer can't cause an address error on the 68000
+    if (unit == NULL || ((ULONG)unit & 1)) return false;
 
-    if (!found) return false;
+    if (unit->cookie != (UNIT_COOKIE ^ (ULONG)unit)) return false;
 
-    if ((struct Device *)dev != ior->io_Device) return false;
+    if (unit->unitNum >= UNIT_TABLE_SIZE || dev->unitTable[unit->unitNum] != unit) return false;
 
     return true;
 }
@@ -512,7 +510,6 @@ static void __attribute__((used, saveds)) open(struct DeviceBase *dev asm("a6"),
 {
     struct IDEUnit *unit = NULL;
     BYTE error = 0;
-    bool found = false;
 
     Trace((CONST_STRPTR) "running open() for unitnum %ld\n",unitnum);
 
@@ -535,25 +532,9 @@ static void __attribute__((used, saveds)) open(struct DeviceBase *dev asm("a6"),
         goto exit;
     }
 
-    if (SysBase->SoftVer >= 36) {
-        ObtainSemaphoreShared(&dev->ulSem);
-    } else {
-        ObtainSemaphore(&dev->ulSem);
-    }
-
-    for (unit = (struct IDEUnit *)dev->units.mlh_Head;
-         unit->mn_Node.mln_Succ != NULL;
-         unit = (struct IDEUnit *)unit->mn_Node.mln_Succ)
-        {
-            if (unit->unitNum == unitnum) {
-                found = true;
-                break;
-            }
-        }
-
-    ReleaseSemaphore(&dev->ulSem);
+    unit = dev->unitTable[unitnum];
 
-    if (found == false || unit->present == false) {
+    if (unit == NULL || unit->present == false) {
         error = TDERR_BadUnitNum;
         goto exit;
     }
@@ -679,6 +660,8 @@ static UWORD supported_commands[] =
     NSCMD_TD_WRITE64,
     NSCMD_TD_FORMAT64,
     HD_SCSICMD,
+    CMD_READEXTENTS,
+    CMD_WRITEEXTENTS,
     0
 };
 
@@ -722,8 +705,6 @@ static void __attribute__((used, saveds)) begin_io(struct DeviceBase *dev asm("a
         Trace("Command %lx\n",ioreq->io_Command);
         switch (ioreq->io_Command) {
             case TD_MOTOR:
-            case CMD_CLEAR:
-            case CMD_UPDATE:
                 ioreq->io_Actual = 0;
                 error            = 0;
                 break;
@@ -795,7 +776,25 @@ static void __attribute__((used, saveds)) begin_io(struct DeviceBase *dev asm("a
             case NSCMD_ETD_FORMAT64:
             case CMD_XFER:
             case CMD_PIO:
+            case CMD_IRQ:
+            case CMD_WCACHE:
+            case CMD_CACHE:
+            case CMD_READAHEAD:
+            case CMD_WRITEBACK:
+            case CMD_ELEVATOR:
+            case CMD_BURST:
+            case CMD_READEXTENTS:
+            case CMD_WRITEEXTENTS:
+            case CMD_OVERLAP:
+            case CMD_CDCACHE:
+            case CMD_UPDATE:
+            case CMD_CLEAR:
             case HD_SCSICMD:
+                // Reads and writes can be done right here if the channel is free
+                if ((ioreq->io_Flags & IOF_QUICK) && ide_quick_io(ioreq)) {
+                    Trace((CONST_STRPTR) "IO done quick\n");
+                    return;
+                }
                 // Send all of these to ide_task
                 ioreq->io_Flags &= ~IOF_QUICK;
                 PutMsg(unit->itask->iomp,&ioreq->io_Message);
@@ -870,6 +869,11 @@ static ULONG __attribute__((used, saveds)) abort_io(struct DeviceBase *dev asm("
                 break;
             }
         }
+        // Not at the port, it may be waiting in the task's queue
+        if (error == 0 && sched_abort(unit->itask,(struct IORequest *)ioreq)) {
+            error = ioreq->io_Error = IOERR_ABORTED;
+            ReplyMsg(&ioreq->io_Message);
+        }
         Enable();
     }
     return error;
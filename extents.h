@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#ifndef _EXTENTS_H
+#define _EXTENTS_H
+
+#include <exec/types.h>
+
+/**
+ * Scatter-gather extent I/O
+ *
+ * CMD_READEXTENTS and CMD_WRITEEXTENTS transfer a list of extents in one IORequest
+ *   io_Data   - Pointer to an array of struct IDEExtent
+ *   io_Length - Number of extents in the array, at most EXTENTS_MAX
+ *
+ * The extents may be served in any order, contiguous extents are transferred with a single command.
+ * Write extents that overlap are written in the order given.
+ * On completion each extent has its own ext_Actual and ext_Error,
+ * io_Actual is the total number of bytes transferred and io_Error the error of the first failed extent.
+*/
+#define CMD_READEXTENTS  0x100A
+#define CMD_WRITEEXTENTS (CMD_READEXTENTS + 1)
+
+#define EXTENTS_MAX 64
+
+struct IDEExtent {
+    ULONG ext_OffsetHi; // High 32 bits of the byte offset
+    ULONG ext_Offset;   // Low 32 bits of the byte offset
+    ULONG ext_Length;   // Bytes, a multiple of the block size
+    APTR  ext_Data;
+    ULONG ext_Actual;   // Set on completion
+    BYTE  ext_Error;    // Set on completion
+    UBYTE ext_Pad[3];
+};
+
+#endif
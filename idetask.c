@@ -2,9 +2,11 @@
 /* This file is part of lide.device
  * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
  */
+#include <devices/keyboard.h>
 #include <devices/scsidisk.h>
 #include <devices/trackdisk.h>
 #include <exec/errors.h>
+#include <hardware/intbits.h>
 #include <proto/alib.h>
 #include <proto/exec.h>
 #include <string.h>
@@ -12,10 +14,14 @@
 
 #include "ata.h"
 #include "atapi.h"
+#include "blockcache.h"
+#include "cdcache.h"
 #include "debug.h"
 #include "device.h"
+#include "extents.h"
 #include "idetask.h"
 #include "newstyle.h"
+#include "sched.h"
 #include "scsi.h"
 #include "td64.h"
 #include "wait.h"
@@ -191,7 +197,9 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
         // Non-ATAPI drives - Translate SCSI CMD to ATA
         switch (scsi_command->scsi_Command[0]) {
             case SCSI_CMD_ATA_PASSTHROUGH:
+                cache_writeback(unit);
                 error = scsi_ata_passthrough(unit,scsi_command);
+                cache_invalidate(unit);
                 break;
 
             case SCSI_CMD_TEST_UNIT_READY:
@@ -211,6 +219,14 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
                 error = scsi_read_capaity_ata(unit,scsi_command);
                 break;
 
+            case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+                if ((error = cache_flush(unit)) != 0 || (error = ata_flush_cache(unit)) != 0) {
+                    scsi_sense(scsi_command,0,0,error);
+                } else {
+                    scsi_command->scsi_Actual = 0;
+                }
+                break;
+
             case SCSI_CMD_READ_6:
             case SCSI_CMD_WRITE_6:
                 lba   = (((((struct SCSI_CDB_6 *)command)->lba_high & 0x1F) << 16) |
@@ -235,9 +251,9 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
                 direction = (scsi_command->scsi_Flags & SCSIF_READ) ? READ : WRITE;
 
                 if (direction == READ) {
-                    error = ata_read(data,lba,count,unit);
+                    error = cache_read(data,lba,count,unit);
                 } else {
-                    error = ata_write(data,lba,count,unit);
+                    error = cache_write(data,lba,count,unit);
                 }
                 if (error == 0) {
                     scsi_command->scsi_Actual = scsi_command->scsi_Length;
@@ -308,6 +324,11 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
                 break;
         }
 
+        // Data written by a SCSI command may be held in the CD cache
+        if (scsi_command->scsi_Length > 0 && !(scsi_command->scsi_Flags & SCSIF_READ)) {
+            cd_cache_invalidate(unit);
+        }
+
         if (error != 0) {
             if (scsi_command->scsi_Flags & (SCSIF_AUTOSENSE)) {
 
@@ -317,7 +338,7 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
                     if ((atapi_autosense(scsi_command,unit)) == 0) 
                         break;
 
-                    wait_us(unit->itask->tr,250000); // Wait 250ms before retrying
+                    wait_us(unit->itask->tr,ATAPI_SENSE_RETRY_US);
                 }
             }
         }
@@ -339,10 +360,388 @@ static BYTE handle_scsi_command(struct IOStdReq *ioreq) {
     return error;
 }
 
+/**
+ * transfer_merged
+ * 
+ * Serve a request together with the requests sched_merge found to continue it, as one run of blocks
+ * The merged requests are replied here each with their own io_Actual and error, the first is left to the caller
+ * 
+ * @param unit Pointer to an IDEUnit struct
+ * @param ioreq The request being served
+ * @param batch Requests taken by sched_merge
+ * @param merged Number of requests in batch
+ * @param lba First block of ioreq
+ * @param direction READ or WRITE
+ * @returns error for ioreq
+*/
+static BYTE transfer_merged(struct IDEUnit *unit, struct IOStdReq *ioreq, struct IOStdReq **batch, ULONG merged, ULONG lba, enum xfer_dir direction) {
+    struct ATAExtent ext[SCHED_MAX_MERGE + 1];
+    struct IOStdReq *req;
+    ULONG done, start;
+    BYTE error;
+
+    ext[0].buffer = ioreq->io_Data;
+    ext[0].count  = ioreq->io_Length >> unit->blockShift;
+
+    for (ULONG i=0; i < merged; i++) {
+        ext[i+1].buffer = batch[i]->io_Data;
+        ext[i+1].count  = batch[i]->io_Length >> unit->blockShift;
+    }
+
+    error = ata_transfer_extents(ext,merged + 1,lba,direction,&done,unit);
+
+    unit->itask->merged += merged;
+
+    start = ext[0].count;
+
+    for (ULONG i=0; i < merged; i++) {
+        req = batch[i];
+
+        if (error && done < start + ext[i+1].count) {
+            req->io_Error  = error;
+            req->io_Actual = (done > start) ? (done - start) << unit->blockShift : 0;
+        } else {
+            req->io_Error  = 0;
+            req->io_Actual = req->io_Length;
+        }
+
+        start += ext[i+1].count;
+        sched_done(req);
+        ReplyMsg(&req->io_Message);
+    }
+
+    if (error && done < ext[0].count) {
+        ioreq->io_Actual = done << unit->blockShift;
+        return error;
+    }
+
+    ioreq->io_Actual = ioreq->io_Length;
+    return 0;
+}
+
+/**
+ * transfer_extents
+ * 
+ * Serve a CMD_READEXTENTS or CMD_WRITEEXTENTS request
+ * The extents are sorted by LBA and each run of contiguous extents is transferred with one ata_transfer_extents call,
+ * write extents that overlap are served in the order given instead.
+ * Through the block cache or on ATAPI units each extent is transferred on its own.
+ * 
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq The request being served
+ * @param direction READ or WRITE
+ * @returns error of the first extent in the list that failed
+*/
+static BYTE transfer_extents(struct IDETask *itask, struct IOStdReq *ioreq, enum xfer_dir direction) {
+    struct IDEUnit *unit     = (struct IDEUnit *)ioreq->io_Unit;
+    struct IDEExtent *list   = ioreq->io_Data;
+    struct IDEExtent *ext;
+    struct ATAExtent *run = itask->extRun; // Extent commands are barriers so they never nest, see sched_next
+    ULONG *lbas  = itask->extLba;
+    UBYTE *order = itask->extOrder;
+    ULONG extents = ioreq->io_Length;
+    ULONG valid   = 0;
+    ULONG i, j, n;
+    ULONG lba, next, count, done, start;
+    unsigned long long offset;
+    UWORD blockShift = unit->blockShift;
+    BYTE  error = 0;
+    bool  single = (unit->atapi || cache_enabled(unit));
+
+    ioreq->io_Actual = 0;
+
+    if (list == NULL || extents == 0 || extents > EXTENTS_MAX) return IOERR_BADLENGTH;
+
+    if (unit->atapi == true && unit->mediumPresent == false) return TDERR_DiskChanged;
+
+    // Check each extent, insert the good ones into order sorted by LBA
+    for (i=0; i < extents; i++) {
+        ext = &list[i];
+        ext->ext_Actual = 0;
+        ext->ext_Error  = 0;
+
+        offset = ((unsigned long long)ext->ext_OffsetHi << 32 | ext->ext_Offset) >> blockShift;
+        count  = (ext->ext_Length >> blockShift);
+
+        if (count == 0 || (ext->ext_Length & (unit->blockSize - 1)) != 0) {
+            ext->ext_Error = IOERR_BADLENGTH;
+            continue;
+        }
+
+        if ((offset >> 32) != 0) {
+            ext->ext_Error = IOERR_BADADDRESS;
+            continue;
+        }
+
+        lba = (ULONG)offset;
+
+        if (count > unit->logicalSectors || lba > unit->logicalSectors - count) {
+            ext->ext_Error = IOERR_BADADDRESS;
+            continue;
+        }
+
+        lbas[i] = lba;
+
+        for (j = valid; j > 0 && lbas[order[j-1]] > lba; j--) {
+            order[j] = order[j-1];
+        }
+
+        order[j] = i;
+        valid++;
+    }
+
+    // Overlapping writes must land in the order given, if any sorted neighbours overlap don't reorder at all
+    if (direction == WRITE) {
+        for (j=1; j < valid; j++) {
+            if (lbas[order[j-1]] + (list[order[j-1]].ext_Length >> blockShift) > lbas[order[j]]) break;
+        }
+
+        if (j < valid) {
+            for (i=0, j=0; i < extents; i++) {
+                if (list[i].ext_Error == 0) order[j++] = i;
+            }
+        }
+    }
+
+    for (j=0; j < valid; j += n) {
+        lba  = lbas[order[j]];
+        next = lba;
+
+        // The first extent always matches so n is at least 1
+        for (n=0; j + n < valid && lbas[order[j+n]] == next; n++) {
+            ext = &list[order[j+n]];
+            run[n].buffer = ext->ext_Data;
+            run[n].count  = ext->ext_Length >> blockShift;
+            next += run[n].count;
+            if (single) {
+                n++;
+                break;
+            }
+        }
+
+        if (single) {
+            ext = &list[order[j]];
+            if (unit->atapi && direction == READ) {
+                ext->ext_Error = cd_cache_read(ext->ext_Data, lba, run[0].count, &ext->ext_Actual, unit);
+            } else if (unit->atapi) {
+                cd_cache_discard(unit, lba, run[0].count);
+                ext->ext_Error = atapi_translate(ext->ext_Data, lba, run[0].count, &ext->ext_Actual, unit, direction);
+            } else if (direction == READ) {
+                ext->ext_Error = cache_read(ext->ext_Data, lba, run[0].count, unit);
+            } else {
+                ext->ext_Error = cache_write(ext->ext_Data, lba, run[0].count, unit);
+            }
+            if (!unit->atapi) ext->ext_Actual = (ext->ext_Error == 0) ? run[0].count << blockShift : 0;
+        } else {
+            error = ata_transfer_extents(run, n, lba, direction, &done, unit);
+
+            itask->merged += n - 1;
+
+            start = 0;
+
+            for (i=0; i < n; i++) {
+                ext = &list[order[j+i]];
+
+                if (error && done < start + run[i].count) {
+                    ext->ext_Error  = error;
+                    ext->ext_Actual = (done > start) ? (done - start) << blockShift : 0;
+                } else {
+                    ext->ext_Actual = run[i].count << blockShift;
+                }
+
+                start += run[i].count;
+            }
+        }
+
+        unit->headLba = next;
+    }
+
+    error = 0;
+
+    for (i=0; i < extents; i++) {
+        ioreq->io_Actual += list[i].ext_Actual;
+        if (error == 0) error = list[i].ext_Error;
+    }
+
+    return error;
+}
+
+/**
+ * ide_irq_server
+ * 
+ * PORTS interrupt server for a channel with interrupts enabled
+ * Reading the status register acknowledges INTRQ so the drive releases the shared INT2 line,
+ * if the task is sleeping in ata_sleep and the drive is no longer busy the task is woken up.
+ * 
+ * @param itask Pointer to the IDETask struct of the channel
+ * @returns 0 so that the rest of the server chain still runs
+*/
+static ULONG __attribute__((used)) ide_irq_server(struct IDETask *itask asm("a1")) {
+    if ((*itask->statusReg & ata_flag_busy) == 0 && itask->irqWait) {
+        itask->irqWait = false;
+        Signal(itask->task,itask->irqMask);
+    }
+    return 0;
+}
+
+/* Exec checks the Z flag rather than d0 on return from a server */
+void ide_irq_entry();
+asm(
+    ".pushsection .text            \n"
+    "_ide_irq_entry:               \n"
+    "       jsr     _ide_irq_server \n"
+    "       tst.l   d0             \n"
+    "       rts                    \n"
+    ".popsection                   \n"
+);
+
+/**
+ * ide_reset_handler
+ * 
+ * keyboard.device reset handler, called when the user presses Ctrl-Amiga-Amiga
+ * Wakes the IDE task to flush the write-back caches, it tells keyboard.device when it is done, see ide_reset_flush
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+static void __attribute__((used)) ide_reset_handler(struct IDETask *itask asm("a1")) {
+    itask->resetting = true;
+    Signal(itask->task,(1 << itask->iomp->mp_SigBit));
+}
+
+/**
+ * ide_add_reset_handler
+ * 
+ * Install the reset handler of an IDE task
+ * Without it a reboot loses whatever is still in the write-back caches
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+static void ide_add_reset_handler(struct IDETask *itask) {
+    itask->resetHandler.is_Node.ln_Type = NT_INTERRUPT;
+    itask->resetHandler.is_Node.ln_Pri  = 0;
+    itask->resetHandler.is_Node.ln_Name = ATA_TASK_NAME;
+    itask->resetHandler.is_Data         = itask;
+    itask->resetHandler.is_Code         = (void *)ide_reset_handler;
+
+    if ((itask->kbdmp = CreatePort(NULL,0)) != NULL && (itask->kbdReq = CreateStdIO(itask->kbdmp)) != NULL) {
+        if (OpenDevice("keyboard.device",0,(struct IORequest *)itask->kbdReq,0) == 0) {
+            itask->kbdReq->io_Command = KBD_ADDRESETHANDLER;
+            itask->kbdReq->io_Data    = &itask->resetHandler;
+            if (DoIO((struct IORequest *)itask->kbdReq) == 0) return;
+
+            CloseDevice((struct IORequest *)itask->kbdReq);
+        }
+        DeleteStdIO(itask->kbdReq);
+    }
+
+    if (itask->kbdmp) DeletePort(itask->kbdmp);
+    itask->kbdmp  = NULL;
+    itask->kbdReq = NULL;
+    Warn("IDE Task %ld: No reset handler, write-back data will be lost on reboot\n",itask->taskNum);
+}
+
+/**
+ * ide_rem_reset_handler
+ * 
+ * Remove the reset handler of an IDE task
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+static void ide_rem_reset_handler(struct IDETask *itask) {
+    if (itask->kbdReq == NULL) return;
+
+    itask->kbdReq->io_Command = KBD_REMRESETHANDLER;
+    itask->kbdReq->io_Data    = &itask->resetHandler;
+    DoIO((struct IORequest *)itask->kbdReq);
+
+    CloseDevice((struct IORequest *)itask->kbdReq);
+    DeleteStdIO(itask->kbdReq);
+    DeletePort(itask->kbdmp);
+    itask->kbdReq = NULL;
+    itask->kbdmp  = NULL;
+}
+
+/**
+ * ide_reset_flush
+ * 
+ * Write out the write-back caches of the task's units for a reset and let keyboard.device carry on with it
+ * Write errors are only logged, there is nobody left to report them to
+ * 
+ * @param itask Pointer to an IDETask struct
+*/
+static void ide_reset_flush(struct IDETask *itask) {
+    struct IDEUnit *unit;
+
+    for (unit = (struct IDEUnit *)itask->dev->units.mlh_Head;
+         unit->mn_Node.mln_Succ != NULL;
+         unit = (struct IDEUnit *)unit->mn_Node.mln_Succ) {
+        if (unit->itask == itask && unit->writeBack != NULL) {
+            cache_writeback(unit);
+            if (unit->writeBack->numBlocks > 0) Warn("IDE Task %ld: unit %ld: %ld blocks lost on reset\n",itask->taskNum,unit->unitNum,unit->writeBack->numBlocks);
+        }
+    }
+
+    itask->resetFlushed = true;
+
+    itask->kbdReq->io_Command = KBD_RESETHANDLERDONE;
+    itask->kbdReq->io_Data    = &itask->resetHandler;
+    DoIO((struct IORequest *)itask->kbdReq);
+}
+
+/**
+ * ide_set_irq
+ * 
+ * Enable or disable interrupt driven waits for the channel serviced by this task
+ * Boards that don't connect INTRQ still work with this enabled, the waits just time out to polling
+ * 
+ * @param itask Pointer to an IDETask struct
+ * @param enable true to install the interrupt server, false to remove it
+ * @returns error
+*/
+static BYTE ide_set_irq(struct IDETask *itask, bool enable) {
+    if (enable == itask->irqEnabled) return 0;
+
+    if (enable) {
+        if (itask->irqSig == -1) return IOERR_NOCMD;
+
+        itask->irqWait                       = false;
+        itask->irqServer.is_Node.ln_Type     = NT_INTERRUPT;
+        itask->irqServer.is_Node.ln_Pri      = 0;
+        itask->irqServer.is_Node.ln_Name     = ATA_TASK_NAME;
+        itask->irqServer.is_Data             = itask;
+        itask->irqServer.is_Code             = ide_irq_entry;
+
+        AddIntServer(INTB_PORTS,&itask->irqServer);
+        itask->irqEnabled = true;
+    } else {
+        itask->irqEnabled = false;
+        RemIntServer(INTB_PORTS,&itask->irqServer);
+    }
+    Info("IDE Task %ld: Interrupts %s\n",itask->taskNum, (enable) ? "enabled" : "disabled");
+    return 0;
+}
+
+/**
+ * ide_must_park
+ *
+ * @param unit Pointer to an IDEUnit struct
+ * @param error Result of a transfer
+ * @returns true if the transfer failed because the unit is spinning up and should be parked, see sched_park
+*/
+static inline bool ide_must_park(struct IDEUnit *unit, BYTE error) {
+    return (unit->atapi && unit->becomingReady && error == IOERR_UNITBUSY);
+}
+
 /**
  * diskchange_task
  *
  * This task periodically polls all removable devices for media changes and updates 
+ *
+ * ATAPI units with requests outstanding are skipped, those would fail if the medium had gone anyway.
+ * Requests for the other unit on the channel don't count, so a busy hard drive can't hide a disc change.
+ * A unit is polled anyway once it has been skipped CHANGEINT_MAX_SKIPS times in a row, e.g. while a player streams audio from it.
+ * The poll interval drops to CHANGEINT_FAST_MS while a unit is becoming ready or has just changed,
+ * and backs off to CHANGEINT_BUSY_MS while units were skipped.
 */
 void __attribute__((noreturn)) diskchange_task () {
     struct ExecBase *SysBase = *(struct ExecBase **)4UL;
@@ -351,7 +750,7 @@ void __attribute__((noreturn)) diskchange_task () {
     struct timerequest *TimerReq = NULL;
     struct IOStdReq *ioreq = NULL, *intreq = NULL;
     struct IDEUnit *unit = NULL;
-    bool present;
+    bool present, busy, fast;
 
     while (task->tc_UserData == NULL); // Wait for Task Data to be populated
     struct DeviceBase *dev = (struct DeviceBase *)task->tc_UserData;
@@ -368,6 +767,8 @@ void __attribute__((noreturn)) diskchange_task () {
     while (1) {
         ioreq->io_Data   = NULL;
         ioreq->io_Length = 0;
+        busy = false;
+        fast = false;
 
         if (SysBase->SoftVer >= 36) {
             ObtainSemaphoreShared(&dev->ulSem);
@@ -379,8 +780,23 @@ void __attribute__((noreturn)) diskchange_task () {
              unit->mn_Node.mln_Succ != NULL;
              unit = (struct IDEUnit *)unit->mn_Node.mln_Succ)
         {
-            if (unit->present && unit->atapi && !unit->deferTUR) {
+            if (unit->present && ((unit->writeBack != NULL && unit->writeBack->numBlocks > 0) || sched_parked(unit->itask,unit))) {
+                // Let the IDE task flush write-back blocks that have gone idle and retry parked transfers, see cache_idle and sched_unpark
+                // Only sent when there is something to do, the tick is a barrier so it waits behind the unit's queue
+                ioreq->io_Command = CMD_TICK;
+                ioreq->io_Unit    = (struct Unit *)unit;
+                PutMsg(unit->itask->iomp,(struct Message *)ioreq);
+                WaitPort(iomp);
+                GetMsg(iomp);
+                ioreq->io_Command = TD_CHANGESTATE;
+            }
+
+            if (unit->present && unit->atapi && (unit->deferTUR || unit->outstanding > 0) && unit->pollSkips < CHANGEINT_MAX_SKIPS) {
+                unit->pollSkips++;
+                busy = true;
+            } else if (unit->present && unit->atapi) {
                 Trace("Testing unit %ld\n",unit->unitNum);
+                unit->pollSkips = 0;
                 ioreq->io_Unit = (struct Unit *)unit;
 
                 PutMsg(unit->itask->iomp,(struct Message *)ioreq); // Send request dirßsectly to the ide task
@@ -404,17 +820,26 @@ void __attribute__((noreturn)) diskchange_task () {
                         }
                     }
                     Permit();
+                    fast = true;
                 }
 
                 unit->mediumPresentPrev = present;
             }
+
+            if (unit->present && unit->atapi && unit->becomingReady) fast = true;
             unit->deferTUR = false;
         }
 
         ReleaseSemaphore(&dev->ulSem);
 
         Trace("Wait...\n");
-        wait(TimerReq,CHANGEINT_INTERVAL);
+        if (fast) {
+            wait_ms(TimerReq,CHANGEINT_FAST_MS);
+        } else if (busy) {
+            wait_ms(TimerReq,CHANGEINT_BUSY_MS);
+        } else {
+            wait(TimerReq,CHANGEINT_INTERVAL);
+        }
     }
 
 die:
@@ -469,7 +894,7 @@ static BYTE init_units(struct IDETask *itask) {
             //
             // See ata_init_unit and device.h for more info
             if (SysBase->AttnFlags & (AFF_68040 | AFF_68060)) {
-                unit->xferMethod = longword_move;
+                unit->xferMethod = longword_move16;
             } else {
                 unit->xferMethod = longword_movem;
             }
@@ -482,11 +907,20 @@ static BYTE init_units(struct IDETask *itask) {
             Warn("testing unit %ld\n",unit->unitNum);
 
             if (ata_init_unit(unit)) {
+                if (BLOCK_CACHE_BLOCKS > 0 && !unit->atapi) cache_set_size(unit,BLOCK_CACHE_BLOCKS);
+                if (READ_AHEAD_BLOCKS > 0 && !unit->atapi) cache_set_readahead(unit,READ_AHEAD_BLOCKS);
+                if (WRITE_BACK_BLOCKS > 0 && !unit->atapi) cache_set_writeback(unit,WRITE_BACK_BLOCKS,WRITE_BACK_ALIGN);
+                if (CD_CACHE_SEGMENTS > 0 && unit->atapi) cd_cache_set_size(unit,CD_CACHE_SEGMENTS);
+                unit->elevator = (ELEVATOR && !unit->nonRotational);
                 num_units++;
                 itask->dev->numUnits++;
                 dev->highestUnit = unit->unitNum;
                 ObtainSemaphore(&dev->ulSem);
                 AddTail((struct List *)&dev->units,(struct Node *)unit);
+                if (unit->unitNum < UNIT_TABLE_SIZE) {
+                    unit->cookie = UNIT_COOKIE ^ (ULONG)unit;
+                    dev->unitTable[unit->unitNum] = unit;
+                }
                 ReleaseSemaphore(&dev->ulSem);
 
             } else {
@@ -506,6 +940,12 @@ static BYTE init_units(struct IDETask *itask) {
  * Clean up after the task, freeing resources etc back to the system
 */
 static void cleanup(struct IDETask *itask) {
+    ide_set_irq(itask,false);
+    ide_rem_reset_handler(itask);
+
+    if (itask->irqSig != -1)
+        FreeSignal(itask->irqSig);
+
     if (itask->iomp)
         DeletePort(itask->iomp);
 
@@ -526,7 +966,12 @@ static void cleanup(struct IDETask *itask) {
             if (unit->itask == itask) {
                 ObtainSemaphore(&itask->dev->ulSem);
                 Remove((struct Node *)unit);
+                if (unit->unitNum < UNIT_TABLE_SIZE && itask->dev->unitTable[unit->unitNum] == unit)
+                    itask->dev->unitTable[unit->unitNum] = NULL;
+                unit->cookie = 0;
                 ReleaseSemaphore(&itask->dev->ulSem);
+                cache_free(unit);
+                cd_cache_free(unit);
                 FreeMem(unit,sizeof(struct IDEUnit));
             }
          }
@@ -537,6 +982,383 @@ static void cleanup(struct IDETask *itask) {
     Signal(itask->parent, SIGF_SINGLE);
 }
 
+static void handle_request(struct IDETask *itask, struct IOStdReq *ioreq);
+
+/**
+ * transfer_sliced
+ *
+ * Transfer blocks for a request in slices of SCHED_SLICE_BLOCKS
+ * Between slices any queued transfer with a higher priority is served first, which bounds how long
+ * an interactive request waits behind a bulk one. Requests served this way are not sliced themselves.
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq The request being served
+ * @param lba First block
+ * @param count Number of blocks
+ * @param direction READ or WRITE
+ * @returns error
+*/
+static BYTE transfer_sliced(struct IDETask *itask, struct IOStdReq *ioreq, ULONG lba, ULONG count, enum xfer_dir direction) {
+    struct IDEUnit *unit = (struct IDEUnit *)ioreq->io_Unit;
+    struct IOStdReq *next;
+    UBYTE *buffer = ioreq->io_Data;
+    ULONG slice;
+    BYTE error = 0;
+    BYTE pri;
+
+    // Large writes bypass the write-back cache, slicing them would stop that
+    if (itask->slicing || count <= SCHED_SLICE_BLOCKS || (direction == WRITE && unit->writeBack != NULL)) {
+        if (direction == READ) {
+            return cache_read(buffer,lba,count,unit);
+        } else {
+            return cache_write(buffer,lba,count,unit);
+        }
+    }
+
+    pri = sched_priority(ioreq);
+
+    while (count > 0) {
+        slice = (count > SCHED_SLICE_BLOCKS) ? SCHED_SLICE_BLOCKS : count;
+
+        if (direction == READ) {
+            error = cache_read(buffer,lba,slice,unit);
+        } else {
+            error = cache_write(buffer,lba,slice,unit);
+        }
+
+        if (error) break;
+
+        buffer += (slice << unit->blockShift);
+        lba    += slice;
+        count  -= slice;
+
+        if (count > 0) {
+            itask->slicing = true;
+            while ((next = sched_preempt(itask,ioreq,pri)) != NULL) {
+                handle_request(itask,next);
+            }
+            itask->slicing = false;
+        }
+    }
+
+    return error;
+}
+
+/**
+ * ide_serve_overlapped
+ *
+ * Serve transfers for the other unit on the channel while an ATAPI unit has released it, see atapi_overlap_release
+ * These are not sliced, so nothing else can get in and start a command on the released unit
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param busy The ATAPI unit that released the channel
+ * @returns number of requests served
+*/
+ULONG ide_serve_overlapped(struct IDETask *itask, struct IDEUnit *busy) {
+    struct IOStdReq *ioreq;
+    ULONG served = 0;
+
+    itask->slicing = true;
+
+    while ((ioreq = sched_other(itask,busy)) != NULL) {
+        handle_request(itask,ioreq);
+        served++;
+    }
+
+    itask->slicing = false;
+    itask->overlapped += served;
+
+    return served;
+}
+
+/**
+ * handle_request
+ *
+ * Serve an IO request and reply to it
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq Pointer to an IOStdReq
+*/
+static void handle_request(struct IDETask *itask, struct IOStdReq *ioreq) {
+    struct IDEUnit *unit = (struct IDEUnit *)ioreq->io_Unit;
+    struct IOExtTD *iotd = (struct IOExtTD *)ioreq;
+    struct IOStdReq *batch[SCHED_MAX_MERGE];
+    UWORD blockShift;
+    ULONG lba;
+    ULONG count;
+    ULONG merged;
+    ULONG offsetHi;
+    BYTE  error = 0;
+    enum xfer_dir direction = WRITE;
+
+    switch (ioreq->io_Command) {
+        case TD_EJECT:
+            if (!unit->atapi) {
+                error  = IOERR_NOCMD;
+                break;
+            }
+            ioreq->io_Actual = (unit->mediumPresent) ? 0 : 1;   // io_Actual reflects the previous state
+
+            bool insert = (ioreq->io_Length == 0) ? true : false;
+
+            if (insert == false) {
+                if (atapi_sync_cache(unit) != 0) Warn("SYNCHRONIZE CACHE failed before eject\n");
+                atapi_update_presence(unit,false); // Immediately update medium presence on Eject
+            }
+
+            error = atapi_start_stop_unit(unit,insert,1);
+            break;
+
+        case CMD_TICK:
+            cache_idle(unit);
+            sched_unpark(itask);
+            error = 0;
+            break;
+
+        case CMD_UPDATE:
+            if (unit->atapi) {
+                // SYNCHRONIZE CACHE is optional for ATAPI devices so failures are not passed on
+                if (atapi_sync_cache(unit) != 0) Warn("SYNCHRONIZE CACHE failed\n");
+                error = 0;
+            } else {
+                error = cache_flush(unit);
+                if (ata_flush_cache(unit) != 0 && error == 0) error = TDERR_NotSpecified;
+            }
+            break;
+
+        case CMD_CLEAR:
+            // Only clean copies are dropped, dirty write-back blocks still have to reach the drive
+            cache_invalidate(unit);
+            cd_cache_invalidate(unit);
+            ioreq->io_Actual = 0;
+            error = 0;
+            break;
+
+        case TD_CHANGESTATE:
+            error   = 0;
+            ioreq->io_Actual = 0;
+            if (unit->atapi) {
+                // While the medium spins up report its last known state rather than waiting for it
+                error = atapi_check_media(unit);
+                ioreq->io_Actual = (error == IOERR_UNITBUSY) ? !unit->mediumPresent : (error != 0);
+                error = 0;
+                break;
+            }
+            ioreq->io_Actual = (((struct IDEUnit *)ioreq->io_Unit)->mediumPresent) ? 0 : 1;
+            break;
+
+        case TD_PROTSTATUS:
+            error  = 0;
+            if (unit->atapi) {
+                if ((error  = atapi_check_wp(unit)) == TDERR_WriteProt) {
+                    error  = 0;
+                    ioreq->io_Actual = 1;
+                    break;
+                }
+            }
+            ioreq->io_Actual = 0; // Not protected
+            break;
+
+        case ETD_READ:
+        case NSCMD_ETD_READ64:
+            direction = READ;
+            goto validate_etd;
+
+        case ETD_WRITE:
+        case ETD_FORMAT:
+        case NSCMD_ETD_WRITE64:
+        case NSCMD_ETD_FORMAT64:
+            direction = WRITE;
+validate_etd:
+            if (iotd->iotd_Count < unit->changeCount) {
+                error  = TDERR_DiskChanged;
+                break;
+            } else {
+                goto transfer;
+            }
+        case CMD_READ:
+        case TD_READ64:
+        case NSCMD_TD_READ64:
+            direction = READ;
+            goto transfer;
+
+        case CMD_WRITE:
+        case TD_WRITE64:
+        case TD_FORMAT:
+        case TD_FORMAT64:
+        case NSCMD_TD_WRITE64:
+        case NSCMD_TD_FORMAT64:
+            direction = WRITE;
+transfer:
+            if (unit->atapi == true && unit->mediumPresent == false) {
+                Trace("Access attempt without media\n");
+                error  = TDERR_DiskChanged;
+                break;
+            }
+            
+            blockShift = ((struct IDEUnit *)ioreq->io_Unit)->blockShift;
+            lba = (((long long)ioreq->io_Actual << 32 | ioreq->io_Offset) >> blockShift);
+            count = (ioreq->io_Length >> blockShift);
+
+            if (count == 0) {
+                error = IOERR_BADLENGTH;
+                break;
+            }
+
+            if ((lba + count) > (unit->logicalSectors)) {
+                Trace("Read past end of device\n");
+                error  = IOERR_BADADDRESS;
+                break;
+            }
+
+            if (unit->atapi == true) {
+                offsetHi = ioreq->io_Actual;
+                if (direction == READ) {
+                    error = cd_cache_read(ioreq->io_Data, lba, count, &ioreq->io_Actual, unit);
+                } else {
+                    cd_cache_discard(unit, lba, count);
+                    error = atapi_translate(ioreq->io_Data, lba, count, &ioreq->io_Actual, unit, direction);
+                }
+                if (ide_must_park(unit,error)) {
+                    ioreq->io_Actual = offsetHi; // High 32 bits of a TD64 offset, needed when it is tried again
+                    sched_park(itask,ioreq);
+                    return;
+                }
+            } else if (!cache_enabled(unit) && (merged = sched_merge(itask,ioreq,batch,SCHED_MAX_MERGE)) > 0) {
+                error  = transfer_merged(unit, ioreq, batch, merged, lba, direction);
+            } else {
+                error  = transfer_sliced(itask, ioreq, lba, count, direction);
+                ioreq->io_Actual = ioreq->io_Length;
+            }
+            break;
+
+        case CMD_READEXTENTS:
+        case CMD_WRITEEXTENTS:
+            error = transfer_extents(itask, ioreq, (ioreq->io_Command == CMD_READEXTENTS) ? READ : WRITE);
+            if (ioreq->io_Actual == 0 && ide_must_park(unit,error)) {
+                sched_park(itask,ioreq);
+                return;
+            }
+            break;
+
+        /* SCSI Direct */
+        case HD_SCSICMD:
+            error = handle_scsi_command(ioreq);
+            break;
+
+        case CMD_XFER:
+            if (ioreq->io_Length < xfer_methods) {
+                ata_set_xfer(unit,ioreq->io_Length);
+                error = 0;
+            } else {
+                error = IOERR_ABORTED;
+            }
+            break;
+
+        case CMD_PIO:
+            if (ioreq->io_Length <= 4) {
+                error = ata_set_pio(unit,ioreq->io_Length);
+            } else {
+                error = IOERR_BADADDRESS;
+            }
+            break;
+
+        case CMD_IRQ:
+            error = ide_set_irq(itask,(ioreq->io_Length != 0));
+            break;
+
+        case CMD_WCACHE:
+            if (unit->atapi) {
+                error = IOERR_NOCMD;
+            } else {
+                error = ata_set_write_cache(unit,(ioreq->io_Length != 0));
+            }
+            break;
+
+        case CMD_CACHE:
+            if (unit->atapi) {
+                error = IOERR_NOCMD;
+            } else {
+                error = cache_set_size(unit,ioreq->io_Length);
+            }
+            break;
+
+        case CMD_READAHEAD:
+            if (unit->atapi) {
+                error = IOERR_NOCMD;
+            } else {
+                error = cache_set_readahead(unit,ioreq->io_Length);
+            }
+            break;
+
+        case CMD_BURST:
+            ata_set_burst(itask,ioreq->io_Length);
+            error = 0;
+            break;
+
+        case CMD_ELEVATOR:
+            unit->elevator = (ioreq->io_Length != 0);
+            error = 0;
+            break;
+
+        case CMD_OVERLAP:
+            if (!unit->overlapSupported) {
+                error = IOERR_NOCMD;
+            } else {
+                unit->overlap = (ioreq->io_Length != 0);
+                error = 0;
+            }
+            break;
+
+        case CMD_CDCACHE:
+            if (!unit->atapi) {
+                error = IOERR_NOCMD;
+            } else {
+                error = cd_cache_set_size(unit,ioreq->io_Length);
+            }
+            break;
+
+        case CMD_WRITEBACK:
+            if (unit->atapi) {
+                error = IOERR_NOCMD;
+            } else {
+                error = cache_set_writeback(unit,ioreq->io_Length,ioreq->io_Offset);
+            }
+            break;
+
+        /* CMD_DIE: Shut down this task and clean up */
+        case CMD_DIE:
+            Info("Task: CMD_DIE: Shutting down IDE Task\n");
+            // Make sure nothing is left in the drive caches
+            for (unit = (struct IDEUnit *)itask->dev->units.mlh_Head;
+                 unit->mn_Node.mln_Succ != NULL;
+                 unit = (struct IDEUnit *)unit->mn_Node.mln_Succ) {
+                if (unit->itask == itask && !unit->atapi) {
+                    cache_flush(unit);
+                    ata_flush_cache(unit);
+                }
+            }
+            cleanup(itask);
+            sched_done(ioreq);
+            ReplyMsg(&ioreq->io_Message);
+            RemTask(NULL);
+            Wait(0);
+            break;
+        default:
+            // Unknown commands.
+            error = IOERR_NOCMD;
+            ioreq->io_Actual = 0;
+            break;
+    }
+
+#if DEBUG & DBG_CMD
+    traceCommand(ioreq);
+#endif
+    ioreq->io_Error = error;
+    sched_done(ioreq);
+    ReplyMsg(&ioreq->io_Message);
+}
+
 /**
  * ide_task
  *
@@ -548,18 +1370,20 @@ void __attribute__((noreturn)) ide_task () {
     struct Task *task = FindTask(NULL);
     struct IDETask *itask = (struct IDETask *)task->tc_UserData;
     struct IOStdReq *ioreq;
-    struct IOExtTD *iotd;
     struct IDEUnit *unit;
-    UWORD blockShift;
-    ULONG lba;
-    ULONG count;
-    BYTE  error = 0;
-    enum xfer_dir direction = WRITE;
 
     itask->task = task;
 
+    // Signal used by the interrupt server to wake us, see ide_set_irq
+    if ((itask->irqSig = AllocSignal(-1)) != -1) {
+        itask->irqMask = (1 << itask->irqSig);
+    }
+
     Trace("IDE Task: CreatePort()\n");
     // Create the MessagePort used to send us requests
+    sched_init(itask);
+    InitSemaphore(&itask->busSem);
+
     if ((itask->iomp = CreatePort(NULL,0)) == NULL) {
         cleanup(itask);
         RemTask(NULL);
@@ -579,12 +1403,21 @@ void __attribute__((noreturn)) ide_task () {
         Wait(0);
     }
 
+    itask->statusReg = (UBYTE *)itask->cd->cd_BoardAddr
+                     + ((itask->channel == 0) ? CHANNEL_0 : CHANNEL_1)
+                     + ata_reg_status;
+
+    ata_calibrate_wait(itask);
+    ata_set_burst(itask,BURST_BUDGET_US);
+
     if (init_units(itask) == 0) {
         cleanup(itask);
         RemTask(NULL);
         Wait(0);
     }
 
+    ide_add_reset_handler(itask);
+
     itask->active = true;
     Signal(itask->parent,SIGF_SINGLE);
 
@@ -592,159 +1425,115 @@ void __attribute__((noreturn)) ide_task () {
         // Main loop, handle IO Requests as they come in.
         Trace("IDE Task: WaitPort()\n");
         Wait(1 << itask->iomp->mp_SigBit); // Wait for an IORequest to show up
+        ObtainSemaphore(&itask->busSem);
 
-        while ((ioreq = (struct IOStdReq *)GetMsg(itask->iomp)) != NULL) {
-            unit = (struct IDEUnit *)ioreq->io_Unit;
-            iotd = (struct IOExtTD *)ioreq;
+        ata_burst_start(itask);
 
-            direction = WRITE;
+        // The write-back memory handler signals the port when memory runs low
+        for (unit = (struct IDEUnit *)itask->dev->units.mlh_Head;
+             unit->mn_Node.mln_Succ != NULL;
+             unit = (struct IDEUnit *)unit->mn_Node.mln_Succ) {
+            if (unit->itask == itask && unit->writeBack && unit->writeBack->flushPending) cache_writeback(unit);
+        }
 
-            switch (ioreq->io_Command) {
-                case TD_EJECT:
-                    if (!unit->atapi) {
-                        error  = IOERR_NOCMD;
-                        break;
-                    }
-                    ioreq->io_Actual = (unit->mediumPresent) ? 0 : 1;   // io_Actual reflects the previous state
+        // The reset handler signals the port too, the flush goes in between requests so the reset isn't held up by a busy queue
+        if (itask->resetting && !itask->resetFlushed) ide_reset_flush(itask);
 
-                    bool insert = (ioreq->io_Length == 0) ? true : false;
+        while ((ioreq = sched_next(itask)) != NULL) {
+            handle_request(itask,ioreq);
+            if (itask->resetting && !itask->resetFlushed) ide_reset_flush(itask);
+        }
 
-                    if (insert == false) atapi_update_presence(unit,false); // Immediately update medium presence on Eject
+        ReleaseSemaphore(&itask->busSem);
+    }
 
-                    error = atapi_start_stop_unit(unit,insert,1);
-                    break;
+}
 
-                case TD_CHANGESTATE:
-                    error   = 0;
-                    ioreq->io_Actual = 0;
-                    if (unit->atapi) {
-                        ioreq->io_Actual = (atapi_test_unit_ready(unit) != 0);
-                        break;
-                    }
-                    ioreq->io_Actual = (((struct IDEUnit *)ioreq->io_Unit)->mediumPresent) ? 0 : 1;
-                    break;
+/**
+ * ide_quick_io
+ * 
+ * Serve a read or write in the caller's context rather than passing it to the IDE task,
+ * this saves two task switches per request.
+ * 
+ * Only done for ATA units when nothing is queued for the channel and the IDE task isn't using it,
+ * and not with interrupts enabled as those wake the IDE task.
+ * Only small transfers with no caching on the unit are taken, so the caller's task never runs the cache code
+ * (allocations, the cache semaphore, read-ahead refills) or a long PIO transfer on its own stack.
+ * The IDE task's timer request is borrowed with its replies redirected to a port on the caller's stack.
+ * 
+ * @param ioreq Pointer to an IOStdReq with IOF_QUICK set
+ * @returns true if the request was served, false if it must be queued
+*/
+bool ide_quick_io(struct IOStdReq *ioreq) {
+    struct IDEUnit *unit   = (struct IDEUnit *)ioreq->io_Unit;
+    struct IDETask *itask  = unit->itask;
+    struct timerequest tr, *savedTr;
+    struct MsgPort port;
+    ULONG lba, count;
+    BYTE sig;
+    BYTE error;
 
-                case TD_PROTSTATUS:
-                    error  = 0;
-                    if (unit->atapi) {
-                        if ((error  = atapi_check_wp(unit)) == TDERR_WriteProt) {
-                            error  = 0;
-                            ioreq->io_Actual = 1;
-                            break;
-                        }
-                    }
-                    ioreq->io_Actual = 0; // Not protected
-                    break;
+    if (unit->atapi || itask->irqEnabled || cache_enabled(unit) || !sched_transfer(ioreq,&lba,&count)) return false;
 
-                case ETD_READ:
-                case NSCMD_ETD_READ64:
-                    direction = READ;
-                    goto validate_etd;
+    if (count > SCHED_SLICE_BLOCKS) return false;
 
-                case ETD_WRITE:
-                case ETD_FORMAT:
-                case NSCMD_ETD_WRITE64:
-                case NSCMD_ETD_FORMAT64:
-                    direction = WRITE;
-validate_etd:
-                    if (iotd->iotd_Count < unit->changeCount) {
-                        error  = TDERR_DiskChanged;
-                        break;
-                    } else {
-                        goto transfer;
-                    }
-                case CMD_READ:
-                case TD_READ64:
-                case NSCMD_TD_READ64:
-                    direction = READ;
-                    goto transfer;
-
-                case CMD_WRITE:
-                case TD_WRITE64:
-                case TD_FORMAT:
-                case TD_FORMAT64:
-                case NSCMD_TD_WRITE64:
-                case NSCMD_TD_FORMAT64:
-                    direction = WRITE;
-transfer:
-                    if (unit->atapi == true && unit->mediumPresent == false) {
-                        Trace("Access attempt without media\n");
-                        error  = TDERR_DiskChanged;
-                        break;
-                    }
-                    
-                    blockShift = ((struct IDEUnit *)ioreq->io_Unit)->blockShift;
-                    lba = (((long long)ioreq->io_Actual << 32 | ioreq->io_Offset) >> blockShift);
-                    count = (ioreq->io_Length >> blockShift);
+    if (ioreq->io_Command == ETD_READ   || ioreq->io_Command == NSCMD_ETD_READ64 ||
+        ioreq->io_Command == ETD_WRITE  || ioreq->io_Command == NSCMD_ETD_WRITE64 ||
+        ioreq->io_Command == ETD_FORMAT || ioreq->io_Command == NSCMD_ETD_FORMAT64)
+        return false;
 
-                    if (count == 0) {
-                        error = IOERR_BADLENGTH;
-                        break;
-                    }
+    if (!AttemptSemaphore(&itask->busSem)) return false;
 
-                    if ((lba + count) > (unit->logicalSectors)) {
-                        Trace("Read past end of device\n");
-                        error  = IOERR_BADADDRESS;
-                        break;
-                    }
+    if (itask->queue.mlh_Head->mln_Succ != NULL ||
+        itask->iomp->mp_MsgList.lh_Head->ln_Succ != NULL ||
+        (sig = AllocSignal(-1)) == -1) {
+        ReleaseSemaphore(&itask->busSem);
+        return false;
+    }
 
-                    if (unit->atapi == true) {
-                        error  = atapi_translate(ioreq->io_Data, lba, count, &ioreq->io_Actual, unit, direction);
-                    } else {
-                        if (direction == READ) {
-                            error  = ata_read(ioreq->io_Data, lba, count, unit);
-                        } else {
-                            error  = ata_write(ioreq->io_Data, lba, count, unit);
-                        }
-                        ioreq->io_Actual = ioreq->io_Length;
-                    }
-                    break;
+    port.mp_Node.ln_Type = NT_MSGPORT;
+    port.mp_Flags        = PA_SIGNAL;
+    port.mp_SigBit       = sig;
+    port.mp_SigTask      = FindTask(NULL);
+    NewList(&port.mp_MsgList);
 
-                /* SCSI Direct */
-                case HD_SCSICMD:
-                    error = handle_scsi_command(ioreq);
-                    break;
+    tr = *itask->tr;
+    tr.tr_node.io_Message.mn_ReplyPort = &port;
+    savedTr   = itask->tr;
+    itask->tr = &tr;
 
-                case CMD_XFER:
-                    if (ioreq->io_Length < 3) {
-                        ata_set_xfer(unit,ioreq->io_Length);
-                        error = 0;
-                    } else {
-                        error = IOERR_ABORTED;
-                    }
-                    break;
+    ata_burst_start(itask);
 
-                case CMD_PIO:
-                    if (ioreq->io_Length <= 4) {
-                        error = ata_set_pio(unit,ioreq->io_Length);
-                    } else {
-                        error = IOERR_BADADDRESS;
-                    }
-                    break;
+    if (count == 0) {
+        error = IOERR_BADLENGTH;
+    } else if ((lba + count) > unit->logicalSectors) {
+        error = IOERR_BADADDRESS;
+    } else {
+        switch (ioreq->io_Command) {
+            case CMD_READ:
+            case TD_READ64:
+            case NSCMD_TD_READ64:
+                error = ata_read(ioreq->io_Data,lba,count,unit);
+                break;
+            default:
+                error = ata_write(ioreq->io_Data,lba,count,unit);
+                break;
+        }
+        ioreq->io_Actual = ioreq->io_Length;
+        unit->headLba    = lba + count;
+    }
 
-                /* CMD_DIE: Shut down this task and clean up */
-                case CMD_DIE:
-                    Info("Task: CMD_DIE: Shutting down IDE Task\n");
-                    cleanup(itask);
-                    ReplyMsg(&ioreq->io_Message);
-                    RemTask(NULL);
-                    Wait(0);
-                    break;
-                default:
-                    // Unknown commands.
-                    error = IOERR_NOCMD;
-                    ioreq->io_Actual = 0;
-                    break;
-            }
+    itask->tr = savedTr;
+    itask->quick++;
+
+    FreeSignal(sig);
+    ReleaseSemaphore(&itask->busSem);
 
 #if DEBUG & DBG_CMD
-            traceCommand(ioreq);
+    traceCommand(ioreq);
 #endif
-            ioreq->io_Error = error;
-            ReplyMsg(&ioreq->io_Message);
-        }
-    }
-
+    ioreq->io_Error = error;
+    return true;
 }
 
 /**
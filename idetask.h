@@ -2,17 +2,36 @@
 /* This file is part of lide.device
  * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
  */
+#include "extents.h"
+
 #define ATA_TASK_NAME    "lide ata task"
 #define CHANGE_TASK_NAME "lide change task"
 #define TASK_PRIORITY 11
 #define TASK_STACK_SIZE 8192
 
-#define CHANGEINT_INTERVAL 2 // Poll units every x seconds for disk change
+#define CHANGEINT_INTERVAL 2    // Poll units every x seconds for disk change
+#define CHANGEINT_BUSY_MS  4000 // Poll interval while a unit has requests outstanding
+#define CHANGEINT_MAX_SKIPS 3   // Polls a busy unit can skip in a row before it is polled anyway
+#define CHANGEINT_FAST_MS  500  // Poll interval while a unit is becoming ready or has just changed
 
 #define CMD_DIE  0x1000
 #define CMD_XFER (CMD_DIE + 1)
 #define CMD_PIO  (CMD_XFER + 1)
+#define CMD_IRQ  (CMD_PIO + 1)
+#define CMD_WCACHE (CMD_IRQ + 1)
+#define CMD_CACHE  (CMD_WCACHE + 1)
+#define CMD_READAHEAD (CMD_CACHE + 1)
+#define CMD_WRITEBACK (CMD_READAHEAD + 1)
+#define CMD_ELEVATOR  (CMD_WRITEBACK + 1)
+#define CMD_BURST     (CMD_ELEVATOR + 1)
+// CMD_READEXTENTS and CMD_WRITEEXTENTS have fixed public values, see extents.h
+_Static_assert(CMD_BURST < CMD_READEXTENTS, "Private commands run into CMD_READEXTENTS, add new ones after CMD_TICK");
+#define CMD_OVERLAP   (CMD_WRITEEXTENTS + 1)
+#define CMD_CDCACHE   (CMD_OVERLAP + 1)
+#define CMD_TICK      (CMD_CDCACHE + 1) // Sent to the IDE task by the change task for units with dirty blocks or parked transfers, not accepted by BeginIO
 
 void ide_task();
+bool ide_quick_io(struct IOStdReq *ioreq);
+ULONG ide_serve_overlapped(struct IDETask *itask, struct IDEUnit *busy);
 void diskchange_task();
 BYTE direct_changestate(struct IDEUnit *unit, struct DeviceBase *dev);
\ No newline at end of file
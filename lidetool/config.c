@@ -19,6 +19,7 @@
 #include <stdbool.h>
 #include <proto/exec.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include "main.h"
 #include "config.h"
@@ -45,6 +46,18 @@ struct Config* configure(int argc, char *argv[]) {
   config->Mode = -1;
   config->Multiple = -1;
   config->Pio = -1;
+  config->MaxTransfer = -1;
+  config->Irq = -1;
+  config->WriteCache = -1;
+  config->Cache = -1;
+  config->ReadAhead = -1;
+  config->Elevator = -1;
+  config->Burst = -1;
+  config->Overlap = -1;
+  config->CdCache = -1;
+  config->BenchUnit = -1;
+  config->WriteBack = -1;
+  config->WriteBackAlign = 0;
   config->Device = "lide.device";
   config->DumpInfo = false;
   config->DumpIdent = false;
@@ -73,6 +86,101 @@ struct Config* configure(int argc, char *argv[]) {
           }
           break;
 
+        case 'x':
+          if (i+1 < argc) {
+            config->MaxTransfer = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'i':
+          if (i+1 < argc) {
+            config->Irq = ((*argv[i+1])-'0') ? 1 : 0;
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'w':
+          if (i+1 < argc) {
+            config->WriteCache = ((*argv[i+1])-'0') ? 1 : 0;
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'c':
+          if (i+1 < argc) {
+            config->Cache = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'r':
+          if (i+1 < argc) {
+            config->ReadAhead = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'b':
+          if (i+1 < argc) {
+            config->WriteBack = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'a':
+          if (i+1 < argc) {
+            config->WriteBackAlign = atol(argv[i+1]);
+            i++;
+          }
+          break;
+
+        case 'e':
+          if (i+1 < argc) {
+            config->Elevator = ((*argv[i+1])-'0') ? 1 : 0;
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'y':
+          if (i+1 < argc) {
+            config->Burst = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'o':
+          if (i+1 < argc) {
+            config->Overlap = ((*argv[i+1])-'0') ? 1 : 0;
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 'C':
+          if (i+1 < argc) {
+            config->CdCache = atol(argv[i+1]);
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
+        case 't':
+          if (i+1 < argc) {
+            config->BenchUnit = (*argv[i+1])-'0';
+            i++;
+            cmd_selected = true;
+          }
+          break;
+
         case 'm':
           if (i+1 < argc) {
             config->Mode = (*argv[i+1])-'0';
@@ -120,5 +228,10 @@ struct Config* configure(int argc, char *argv[]) {
  * @brief Print the usage information
 */
 void usage() {
-    printf("\nUsage: lidetool -u <unit> -m <method> [-d <device>] [-P <pio mode>] [-p] [-I]\n\n");
+    printf("\nUsage: lidetool -u <unit> -m <method> [-d <device>] [-P <pio mode>] [-x <sectors>] [-i <0|1>] [-w <0|1>] [-c <blocks>] [-r <blocks>] [-b <blocks> [-a <align>]] [-e <0|1>] [-y <us>] [-o <0|1>] [-C <segments>] [-t <unit>] [-p] [-I]\n\n");
+    printf("Transfer methods:\n");
+    printf("  0: movem\n");
+    printf("  1: move\n");
+    printf("  2: move (68020/030)\n");
+    printf("  3: move16 (68040/060)\n\n");
 }
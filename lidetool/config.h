@@ -23,6 +23,18 @@ struct Config {
   int Mode;
   int Pio;
   int Multiple;
+  long MaxTransfer;
+  int Irq;
+  int WriteCache;
+  long Cache;
+  long ReadAhead;
+  int Elevator;
+  long Burst;
+  int Overlap;
+  long CdCache;
+  int BenchUnit;
+  long WriteBack;
+  long WriteBackAlign;
   char *Device;
   bool DumpInfo;
   bool DumpIdent;
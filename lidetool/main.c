@@ -24,7 +24,10 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "../device.h"
+#include "../blockcache.h"
+#include "../cdcache.h"
 #include <devices/scsidisk.h>
+#include <devices/timer.h>
 #include <devices/trackdisk.h>
 
 #include "main.h"
@@ -36,6 +39,13 @@
 struct ExecBase *SysBase;
 struct Config *config;
 
+static const char *xfer_names[xfer_methods] = {
+  "movem",
+  "move",
+  "move (68020/030)",
+  "move16 (68040/060)"
+};
+
 /**
  * MakeSCSICmd
  * 
@@ -146,6 +156,24 @@ static void doScsiInquiry(struct IOStdReq *req) {
   }
 }
 
+/**
+ * printSpeed
+ * 
+ * Print a measured transfer speed in MB/s
+ * 
+ * @param name Name of the transfer routine
+ * @param kbps Speed in KB/s, 0 if not measured
+ */
+static void printSpeed(const char *name, ULONG kbps) {
+  if (kbps > 0) {
+    printf("  %-18s %ld.%02ld MB/s\n", name,
+      (long int)(kbps / 1024),
+      (long int)(((kbps % 1024) * 100) / 1024));
+  } else {
+    printf("  %-18s n/a\n", name);
+  }
+}
+
 /** 
  * DumpUnit
  * 
@@ -158,7 +186,15 @@ static void DumpUnit(struct IOStdReq *req) {
     struct IDEUnit *unit = (struct IDEUnit *)req->io_Unit;
 
     printf("Device Type:         %d\n", unit->deviceType);
-    printf("Transfer method:     %d\n", unit->xferMethod);
+    if (unit->xferMethod < xfer_methods) {
+      printf("Transfer method:     %d - %s\n", unit->xferMethod, xfer_names[unit->xferMethod]);
+    } else {
+      printf("Transfer method:     %d\n", unit->xferMethod);
+    }
+    for (int i=0; i<xfer_methods; i++) {
+      printSpeed(xfer_names[i], unit->xferSpeed[i]);
+    }
+    printSpeed("unaligned", unit->xferSpeedUnaligned);
     printf("Primary:             %s\n", (unit->primary) ? "Yes" : "No");
     printf("ATAPI:               %s\n", (unit->atapi) ? "Yes" : "No");
     printf("Medium Present:      %s\n", (unit->mediumPresent) ? "Yes" : "No");
@@ -168,6 +204,56 @@ static void DumpUnit(struct IOStdReq *req) {
     printf("Logical Sectors:     %ld\n", (long int)unit->logicalSectors);
     printf("READ/WRITE Multiple: %s\n", (unit->xferMultiple) ? "Yes" : "No");
     printf("Multiple count:      %d\n", unit->multipleCount);
+    printf("Max transfer:        %ld sectors\n", (long int)unit->maxTransfer);
+    printf("Read look-ahead:     %s\n", (unit->lookAhead) ? "Enabled" : "Disabled");
+    printf("APM level:           ");
+    if (unit->apmLevel) printf("%d\n", unit->apmLevel); else printf("Disabled\n");
+    printf("AAM level:           ");
+    if (unit->aamLevel) printf("%d\n", unit->aamLevel); else printf("Disabled\n");
+    printf("Write cache:         %s\n", (!unit->writeCacheSupported) ? "Not supported" : (unit->writeCache) ? "Enabled" : "Disabled");
+    printf("Media:               %s\n", (unit->nonRotational) ? "Non-rotating" : "Rotating");
+    printf("Scheduling:          %s\n", (unit->elevator) ? "C-SCAN" : "FIFO");
+    printf("Quick requests:      %ld\n", (long int)unit->itask->quick);
+    printf("Merged requests:     %ld\n", (long int)unit->itask->merged);
+    printf("Preempted requests:  %ld\n", (long int)unit->itask->preempted);
+    printf("CPU burst budget:    ");
+    if (unit->itask->burstUs) printf("%ld us\n", (long int)unit->itask->burstUs); else printf("Disabled\n");
+    printf("CPU yields:          %ld\n", (long int)unit->itask->yields);
+    if (unit->atapi) {
+      printf("Overlapped commands: %s\n", (!unit->overlapSupported) ? "Not supported" : (unit->overlap) ? "Enabled" : "Disabled");
+    }
+    printf("Channel releases:    %ld (%ld requests served)\n", (long int)unit->itask->releases, (long int)unit->itask->overlapped);
+    printf("Interrupts:          %s\n", (unit->itask->irqEnabled) ? "Enabled" : "Disabled");
+    printf("Status polls per ms: %ld\n", (long int)unit->itask->pollsPerMs);
+    printf("Taskfile writes:     %ld (%ld skipped)\n", (long int)unit->itask->tfWrites, (long int)unit->itask->tfSkipped);
+    printf("Last wait:           %ld us\n", (long int)unit->waitLast);
+    printf("Longest wait:        %ld us\n", (long int)unit->waitMax);
+    if (unit->cache != NULL && unit->cache->maxBlocks > 0) {
+      printf("Block cache:         %ld/%ld blocks\n", (long int)unit->cache->numBlocks, (long int)unit->cache->maxBlocks);
+      printf("Cache hits/misses:   %ld/%ld\n", (long int)unit->cache->hits, (long int)unit->cache->misses);
+    } else {
+      printf("Block cache:         Disabled\n");
+    }
+    if (unit->readAhead != NULL) {
+      printf("Read-ahead window:   %ld/%ld blocks\n", (long int)unit->readAhead->window, (long int)unit->readAhead->maxBlocks);
+      printf("Read-ahead hits:     %ld of %ld blocks\n", (long int)unit->readAhead->hits, (long int)unit->readAhead->prefetched);
+    } else {
+      printf("Read-ahead:          Disabled\n");
+    }
+    if (unit->writeBack != NULL) {
+      printf("Write-back:          %ld/%ld blocks dirty, align %ld\n", (long int)unit->writeBack->numBlocks, (long int)unit->writeBack->maxBlocks, (long int)unit->writeBack->align);
+      printf("Write-back blocks:   %ld absorbed, %ld written in %ld commands\n", (long int)unit->writeBack->absorbed, (long int)unit->writeBack->written, (long int)unit->writeBack->writes);
+    } else {
+      printf("Write-back:          Disabled\n");
+    }
+    if (unit->atapi) {
+      if (unit->cdCache != NULL) {
+        printf("CD cache:            %ld segments of %ld KB\n", (long int)unit->cdCache->numSegments, (long int)(CD_CACHE_SEGMENT_SIZE / 1024));
+        printf("CD cache blocks:     %ld hits, %ld misses, %ld prefetched\n", (long int)unit->cdCache->hits, (long int)unit->cdCache->misses, (long int)unit->cdCache->prefetched);
+      } else {
+        printf("CD cache:            Disabled\n");
+      }
+    }
     printf("Last Error: ");
     for (int i=0; i<6; i++) {
       printf("%02x ",unit->last_error[i]);
@@ -224,6 +310,380 @@ BYTE setPio(struct IOStdReq *req,int pio) {
   return error;
 }
 
+/**
+ * setIrq
+ * 
+ * Enable or disable interrupt driven waits on the channel of the unit
+ * 
+ * @param req An open IOStdReq
+ * @param enable 1 to enable, 0 to disable
+ */
+BYTE setIrq(struct IOStdReq *req, int enable) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = enable;
+  req->io_Command = CMD_IRQ;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Interrupts %s for unit %d\n", (enable) ? "enabled" : "disabled", config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setWriteCache
+ * 
+ * Enable or disable the drive write cache
+ * 
+ * @param req An open IOStdReq
+ * @param enable 1 to enable, 0 to disable
+ */
+BYTE setWriteCache(struct IOStdReq *req, int enable) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = enable;
+  req->io_Command = CMD_WCACHE;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Write cache %s for unit %d\n", (enable) ? "enabled" : "disabled", config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setCache
+ * 
+ * Set the size of the block cache of the unit
+ * 
+ * @param req An open IOStdReq
+ * @param blocks Number of blocks to cache, 0 to disable
+ */
+BYTE setCache(struct IOStdReq *req, long blocks) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = blocks;
+  req->io_Command = CMD_CACHE;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Block cache set to %ld blocks for unit %d\n", blocks, config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setReadAhead
+ * 
+ * Set the largest read-ahead window of the unit
+ * 
+ * @param req An open IOStdReq
+ * @param blocks Window size in blocks, 0 to disable
+ */
+BYTE setReadAhead(struct IOStdReq *req, long blocks) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = blocks;
+  req->io_Command = CMD_READAHEAD;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Read-ahead set to %ld blocks for unit %d\n", blocks, config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setWriteBack
+ * 
+ * Set the dirty block limit and flush alignment of the write-back cache of the unit
+ * 
+ * @param req An open IOStdReq
+ * @param blocks Largest number of dirty blocks, 0 to disable
+ * @param align Flush alignment in blocks, 0 for none
+ */
+BYTE setWriteBack(struct IOStdReq *req, long blocks, long align) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = align;
+  req->io_Length  = blocks;
+  req->io_Command = CMD_WRITEBACK;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Write-back set to %ld blocks for unit %d\n", blocks, config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setElevator
+ * 
+ * Switch the unit between C-SCAN and FIFO scheduling
+ * 
+ * @param req An open IOStdReq
+ * @param enable 1 for C-SCAN, 0 for FIFO
+ */
+BYTE setElevator(struct IOStdReq *req, int enable) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = enable;
+  req->io_Command = CMD_ELEVATOR;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("%s scheduling set for unit %d\n", (enable) ? "C-SCAN" : "FIFO", config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setBurst
+ * 
+ * Set the CPU burst budget of the channel of the unit
+ * 
+ * @param req An open IOStdReq
+ * @param micros Budget in microseconds, 0 to never yield
+ */
+BYTE setBurst(struct IOStdReq *req, long micros) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = micros;
+  req->io_Command = CMD_BURST;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("CPU burst budget set to %ld us for unit %d\n", micros, config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setCdCache
+ * 
+ * Set the number of CD cache segments of an ATAPI unit
+ * 
+ * @param req An open IOStdReq
+ * @param segments Number of segments, 0 to disable
+ */
+BYTE setCdCache(struct IOStdReq *req, long segments) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = segments;
+  req->io_Command = CMD_CDCACHE;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("CD cache set to %ld segments for unit %d\n", segments, config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * setOverlap
+ * 
+ * Enable or disable overlapped PACKET commands on an ATAPI unit
+ * 
+ * @param req An open IOStdReq
+ * @param enable 1 to enable, 0 to disable
+ */
+BYTE setOverlap(struct IOStdReq *req, int enable) {
+  BYTE error = 0;
+
+  req->io_Data    = NULL;
+  req->io_Offset  = 0;
+  req->io_Length  = enable;
+  req->io_Command = CMD_OVERLAP;
+  error = DoIO((struct IORequest *)req);
+  if (error == 0) {
+    printf("Overlapped commands %s for unit %d\n", (enable) ? "enabled" : "disabled", config->Unit);
+  } else {
+    printf("IO Error %d\n", error);
+  }
+
+  return error;
+}
+
+/**
+ * getTimeMs
+ * 
+ * @param tr An open timerequest
+ * @returns the system time in milliseconds
+ */
+static ULONG getTimeMs(struct timerequest *tr) {
+  tr->tr_node.io_Command = TR_GETSYSTIME;
+  DoIO((struct IORequest *)tr);
+  return (tr->tr_time.tv_sec * 1000) + (tr->tr_time.tv_micro / 1000);
+}
+
+/**
+ * benchRead
+ * 
+ * Read BENCH_BYTES from the start of each unit at the same time, BENCH_CHUNK at a time
+ * All of the requests must share a reply port
+ * 
+ * @param reqs Open IOStdReqs
+ * @param bufs A BENCH_CHUNK buffer for each request
+ * @param count Number of requests, 1 or 2
+ * @param ms Time taken by each request in milliseconds
+ * @param tr An open timerequest with its own reply port
+ * @returns the first error
+ */
+static BYTE benchRead(struct IOStdReq **reqs, UBYTE **bufs, int count, ULONG *ms, struct timerequest *tr) {
+  struct MsgPort *mp = reqs[0]->io_Message.mn_ReplyPort;
+  ULONG offset[2];
+  ULONG start;
+  BYTE error = 0;
+  int active = 0;
+
+  start = getTimeMs(tr);
+
+  for (int i=0; i<count; i++) {
+    offset[i] = 0;
+    reqs[i]->io_Command = CMD_READ;
+    reqs[i]->io_Data    = bufs[i];
+    reqs[i]->io_Length  = BENCH_CHUNK;
+    reqs[i]->io_Offset  = 0;
+    SendIO((struct IORequest *)reqs[i]);
+    active++;
+  }
+
+  while (active > 0) {
+    Wait(1L << mp->mp_SigBit);
+
+    for (int i=0; i<count; i++) {
+      if (offset[i] >= BENCH_BYTES || !CheckIO((struct IORequest *)reqs[i])) continue;
+
+      if (WaitIO((struct IORequest *)reqs[i]) != 0) {
+        if (error == 0) error = reqs[i]->io_Error;
+        offset[i] = BENCH_BYTES;
+      } else {
+        offset[i] += BENCH_CHUNK;
+      }
+
+      if (offset[i] < BENCH_BYTES) {
+        reqs[i]->io_Offset = offset[i];
+        reqs[i]->io_Length = BENCH_CHUNK;
+        SendIO((struct IORequest *)reqs[i]);
+      } else {
+        ms[i] = getTimeMs(tr) - start;
+        if (ms[i] == 0) ms[i] = 1;
+        active--;
+      }
+    }
+  }
+
+  return error;
+}
+
+/**
+ * benchmark
+ * 
+ * Measure the read speed of the unit and of another unit, first each on its own and then both at once
+ * With a hard disk and a CD-ROM on the same channel this shows how much the channel is shared
+ * 
+ * @param req An open IOStdReq
+ * @param other Unit number of the other unit
+ */
+static void benchmark(struct IOStdReq *req, int other) {
+  struct MsgPort *mp = req->io_Message.mn_ReplyPort;
+  struct MsgPort *timerMp = NULL;
+  struct timerequest *tr = NULL;
+  struct IOStdReq *reqs[2] = {req, NULL};
+  UBYTE *bufs[2] = {NULL, NULL};
+  ULONG ms[2];
+  ULONG kb = BENCH_BYTES / 1024;
+  char name[20];
+  BYTE error;
+
+  if ((timerMp = CreateMsgPort()) == NULL ||
+      (tr = CreateIORequest(timerMp,sizeof(struct timerequest))) == NULL ||
+      OpenDevice("timer.device",UNIT_MICROHZ,(struct IORequest *)tr,0) != 0) {
+    printf("Failed to open timer.device\n");
+    goto done;
+  }
+
+  if ((reqs[1] = CreateIORequest(mp,sizeof(struct IOStdReq))) == NULL ||
+      OpenDevice(config->Device,other,(struct IORequest *)reqs[1],0) != 0) {
+    printf("Failed to open unit %d\n", other);
+    if (reqs[1]) DeleteIORequest(reqs[1]);
+    reqs[1] = NULL;
+    goto done;
+  }
+
+  if ((bufs[0] = AllocMem(BENCH_CHUNK,MEMF_ANY)) == NULL || (bufs[1] = AllocMem(BENCH_CHUNK,MEMF_ANY)) == NULL) {
+    printf("Failed to allocate memory.\n");
+    goto done;
+  }
+
+  printf("Read benchmark, %ld KB from each unit:\n", (long int)kb);
+
+  for (int i=0; i<2; i++) {
+    if ((error = benchRead(&reqs[i],&bufs[i],1,&ms[i],tr)) != 0) {
+      printf("IO Error %d\n", error);
+      goto done;
+    }
+    sprintf(name, "unit %d alone", (i == 0) ? config->Unit : other);
+    printSpeed(name, (kb * 1000) / ms[i]);
+  }
+
+  if ((error = benchRead(reqs,bufs,2,ms,tr)) != 0) {
+    printf("IO Error %d\n", error);
+    goto done;
+  }
+
+  for (int i=0; i<2; i++) {
+    sprintf(name, "unit %d mixed", (i == 0) ? config->Unit : other);
+    printSpeed(name, (kb * 1000) / ms[i]);
+  }
+  printSpeed("combined", (kb * 2 * 1000) / ((ms[0] > ms[1]) ? ms[0] : ms[1]));
+
+done:
+  if (bufs[0]) FreeMem(bufs[0],BENCH_CHUNK);
+  if (bufs[1]) FreeMem(bufs[1],BENCH_CHUNK);
+  if (reqs[1]) {
+    CloseDevice((struct IORequest *)reqs[1]);
+    DeleteIORequest(reqs[1]);
+  }
+  if (tr) {
+    if (tr->tr_node.io_Device) CloseDevice((struct IORequest *)tr);
+    DeleteIORequest(tr);
+  }
+  if (timerMp) DeleteMsgPort(timerMp);
+}
+
 /**
  * ident
  * 
@@ -306,6 +766,28 @@ static void setMultiple(struct IOStdReq *req, int multiple) {
   }
 
 }
+/**
+ * setMaxTransfer
+ * 
+ * Set the maximum number of sectors transferred per READ/WRITE command
+ * Only LBA48 drives can go past 256 sectors
+ * 
+ * @param req An open IOStdReq
+ * @param sectors Sector count
+ * 
+*/
+static void setMaxTransfer(struct IOStdReq *req, long sectors) {
+  struct IDEUnit *unit = (struct IDEUnit *)req->io_Unit;
+  long limit = (unit->lba48) ? 65536 : 256;
+
+  if (sectors < 1 || sectors > limit) {
+    printf("Max transfer must be between 1 and %ld sectors.\n", limit);
+  } else {
+    unit->maxTransfer = sectors;
+    printf("set max transfer: %ld\n", sectors);
+  }
+}
+
 int main(int argc, char *argv[])
 {
   SysBase = *((struct ExecBase **)4UL);
@@ -342,10 +824,54 @@ int main(int argc, char *argv[])
             setMultiple(req,config->Multiple);
           }
 
+          if (config->MaxTransfer >= 0) {
+            setMaxTransfer(req,config->MaxTransfer);
+          }
+
           if (config->Pio >= 0) {
             setPio(req,config->Pio);
           }
 
+          if (config->Irq >= 0) {
+            setIrq(req,config->Irq);
+          }
+
+          if (config->WriteCache >= 0) {
+            setWriteCache(req,config->WriteCache);
+          }
+
+          if (config->Cache >= 0) {
+            setCache(req,config->Cache);
+          }
+
+          if (config->ReadAhead >= 0) {
+            setReadAhead(req,config->ReadAhead);
+          }
+
+          if (config->Burst >= 0) {
+            setBurst(req,config->Burst);
+          }
+
+          if (config->Elevator >= 0) {
+            setElevator(req,config->Elevator);
+          }
+
+          if (config->WriteBack >= 0) {
+            setWriteBack(req,config->WriteBack,config->WriteBackAlign);
+          }
+
+          if (config->Overlap >= 0) {
+            setOverlap(req,config->Overlap);
+          }
+
+          if (config->CdCache >= 0) {
+            setCdCache(req,config->CdCache);
+          }
+
+          if (config->BenchUnit >= 0) {
+            benchmark(req,config->BenchUnit);
+          }
+
           if (config->DumpIdent) {
             identify(req);
           }
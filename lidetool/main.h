@@ -19,6 +19,7 @@
 #ifndef MAIN_H
 #define MAIN_H
 
+#include "../extents.h"
 
 struct __attribute__((packed)) SCSI_Inquiry {
     UBYTE peripheral_type;
@@ -49,6 +50,19 @@ struct __attribute__((packed)) SCSI_CDB_10 {
 
 #define CMD_XFER 0x1001
 #define CMD_PIO  (CMD_XFER + 1)
+#define CMD_IRQ  (CMD_PIO + 1)
+#define CMD_WCACHE (CMD_IRQ + 1)
+#define CMD_CACHE  (CMD_WCACHE + 1)
+#define CMD_READAHEAD (CMD_CACHE + 1)
+#define CMD_WRITEBACK (CMD_READAHEAD + 1)
+#define CMD_ELEVATOR  (CMD_WRITEBACK + 1)
+#define CMD_BURST     (CMD_ELEVATOR + 1)
+_Static_assert(CMD_BURST < CMD_READEXTENTS, "Private commands run into CMD_READEXTENTS");
+#define CMD_OVERLAP   (CMD_WRITEEXTENTS + 1)
+#define CMD_CDCACHE   (CMD_OVERLAP + 1)
+
+#define BENCH_BYTES (4 * 1024 * 1024) // Read from each unit by the mixed benchmark
+#define BENCH_CHUNK (64 * 1024)       // Size of each read
 
 
 #endif
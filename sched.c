@@ -0,0 +1,540 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#include <devices/trackdisk.h>
+#include <exec/errors.h>
+#include <exec/ports.h>
+#include <exec/tasks.h>
+#include <proto/exec.h>
+#include <stdbool.h>
+
+#include "debug.h"
+#include "device.h"
+#include "newstyle.h"
+#include "sched.h"
+#include "td64.h"
+#include "wait.h"
+
+/**
+ * sched_init
+ *
+ * Set up the request queue of an IDE task
+ *
+ * @param itask Pointer to an IDETask struct
+*/
+void sched_init(struct IDETask *itask) {
+    itask->queue.mlh_Tail     = NULL;
+    itask->queue.mlh_Head     = (struct MinNode *)&itask->queue.mlh_Tail;
+    itask->queue.mlh_TailPred = (struct MinNode *)&itask->queue;
+    itask->bypass             = 0;
+
+    itask->parked.mlh_Tail     = NULL;
+    itask->parked.mlh_Head     = (struct MinNode *)&itask->parked.mlh_Tail;
+    itask->parked.mlh_TailPred = (struct MinNode *)&itask->parked;
+}
+
+/**
+ * sched_transfer
+ *
+ * Check if a request is a block transfer and get its position
+ *
+ * @param ioreq Pointer to an IOStdReq
+ * @param lba Pointer to the first block of the transfer
+ * @param count Pointer to the number of blocks
+ * @returns true if the request is a transfer
+*/
+bool sched_transfer(struct IOStdReq *ioreq, ULONG *lba, ULONG *count) {
+    struct IDEUnit *unit = (struct IDEUnit *)ioreq->io_Unit;
+
+    switch (ioreq->io_Command) {
+        case CMD_READ:
+        case CMD_WRITE:
+        case TD_FORMAT:
+        case TD_READ64:
+        case TD_WRITE64:
+        case TD_FORMAT64:
+        case NSCMD_TD_READ64:
+        case NSCMD_TD_WRITE64:
+        case NSCMD_TD_FORMAT64:
+        case ETD_READ:
+        case ETD_WRITE:
+        case ETD_FORMAT:
+        case NSCMD_ETD_READ64:
+        case NSCMD_ETD_WRITE64:
+        case NSCMD_ETD_FORMAT64:
+            *lba   = (((long long)ioreq->io_Actual << 32 | ioreq->io_Offset) >> unit->blockShift);
+            *count = (ioreq->io_Length >> unit->blockShift);
+            return true;
+
+        default:
+            return false;
+    }
+}
+
+/**
+ * sched_is_read
+ *
+ * @param command IO command of a transfer
+ * @returns true if the command reads from the unit
+*/
+static inline bool sched_is_read(UWORD command) {
+    return (command == CMD_READ || command == TD_READ64 || command == NSCMD_TD_READ64 ||
+            command == ETD_READ || command == NSCMD_ETD_READ64);
+}
+
+/**
+ * sched_conflict
+ *
+ * Check if two transfers must be served in the order they were queued,
+ * that is when they are to the same unit, their blocks overlap and at least one of them writes
+ *
+ * @param a Pointer to an IOStdReq
+ * @param b Pointer to an IOStdReq
+ * @returns true if the transfers can't be reordered
+*/
+static bool sched_conflict(struct IOStdReq *a, struct IOStdReq *b) {
+    ULONG lbaA, countA, lbaB, countB;
+
+    if (a->io_Unit != b->io_Unit) return false;
+
+    if (sched_is_read(a->io_Command) && sched_is_read(b->io_Command)) return false;
+
+    if (!sched_transfer(a,&lbaA,&countA) || !sched_transfer(b,&lbaB,&countB)) return true;
+
+    return (lbaA < lbaB + countB && lbaB < lbaA + countA);
+}
+
+/**
+ * sched_blocked
+ *
+ * Check if a queued transfer can be served ahead of the requests queued before it
+ * Must be called inside Disable()
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq Pointer to a queued IOStdReq
+ * @returns true if a request queued before it conflicts with it, see sched_conflict
+*/
+static bool sched_blocked(struct IDETask *itask, struct IOStdReq *ioreq) {
+    struct IOStdReq *earlier;
+
+    for (earlier = (struct IOStdReq *)itask->queue.mlh_Head;
+         earlier != ioreq && earlier->io_Message.mn_Node.ln_Succ != NULL;
+         earlier = (struct IOStdReq *)earlier->io_Message.mn_Node.ln_Succ) {
+        if (sched_conflict(earlier,ioreq)) return true;
+    }
+
+    return false;
+}
+
+/**
+ * sched_pull
+ *
+ * Move all requests waiting at the task's port to the end of its queue
+ * Each one counts as outstanding for its unit until sched_done
+ * Must be called inside Disable()
+ *
+ * @param itask Pointer to an IDETask struct
+*/
+static void sched_pull(struct IDETask *itask) {
+    struct IOStdReq *ioreq;
+
+    while ((ioreq = (struct IOStdReq *)GetMsg(itask->iomp)) != NULL) {
+        AddTail((struct List *)&itask->queue,(struct Node *)ioreq);
+        ((struct IDEUnit *)ioreq->io_Unit)->outstanding++;
+    }
+}
+
+/**
+ * sched_done
+ *
+ * Stop counting a request as outstanding for its unit, called just before it is replied
+ * Parked requests are still outstanding
+ *
+ * @param ioreq Pointer to an IOStdReq taken from the queue
+*/
+void sched_done(struct IOStdReq *ioreq) {
+    struct IDEUnit *unit = (struct IDEUnit *)ioreq->io_Unit;
+
+    Disable(); // sched_abort may drop a request of the same unit from another task
+    if (unit->outstanding > 0) unit->outstanding--;
+    Enable();
+}
+
+/**
+ * sched_priority
+ *
+ * Get the priority of a request
+ * This is the priority of the message if the sender set one, otherwise that of the task it will be replied to
+ *
+ * @param ioreq Pointer to an IOStdReq
+ * @returns priority
+*/
+BYTE sched_priority(struct IOStdReq *ioreq) {
+    struct MsgPort *port = ioreq->io_Message.mn_ReplyPort;
+
+    if (ioreq->io_Message.mn_Node.ln_Pri != 0 || port == NULL ||
+        (port->mp_Flags & PF_ACTION) != PA_SIGNAL || port->mp_SigTask == NULL)
+        return ioreq->io_Message.mn_Node.ln_Pri;
+
+    return ((struct Task *)port->mp_SigTask)->tc_Node.ln_Pri;
+}
+
+/**
+ * sched_next
+ *
+ * Get the next request for the IDE task to serve
+ *
+ * All requests waiting at the task's port are moved to its queue, the queue keeps them in arrival order.
+ * Any command other than a transfer is a barrier, requests queued after it are not considered until it has been served.
+ *
+ * Among the transfers ahead of the first barrier those with the highest priority go first.
+ * A transfer is never served ahead of an earlier one to the same unit that overlaps it when either of them writes, see sched_blocked.
+ * If the unit of the oldest of these has the elevator enabled its transfers of that priority are served in C-SCAN order,
+ * the one at or after the end of the last transfer with the lowest LBA goes next, wrapping back to the lowest LBA queued.
+ *
+ * The oldest request is served once it has been passed over SCHED_MAX_BYPASS times so nothing waits forever.
+ *
+ * The queue is only changed inside Disable() so that abort_io can search it
+ *
+ * @param itask Pointer to an IDETask struct
+ * @returns Pointer to an IOStdReq or NULL if there are none waiting
+*/
+struct IOStdReq *sched_next(struct IDETask *itask) {
+    struct IOStdReq *ioreq, *oldest, *first, *ahead = NULL, *wrap = NULL;
+    struct IDEUnit *unit;
+    ULONG lba, count, aheadLba = 0, wrapLba = 0;
+    BYTE pri;
+
+    Disable();
+
+    sched_pull(itask);
+
+    oldest = (struct IOStdReq *)itask->queue.mlh_Head;
+
+    if (oldest->io_Message.mn_Node.ln_Succ == NULL) {
+        Enable();
+        return NULL;
+    }
+
+    first = oldest;
+    pri   = sched_priority(oldest);
+
+    if (itask->bypass < SCHED_MAX_BYPASS && sched_transfer(oldest,&lba,&count)) {
+        for (ioreq = (struct IOStdReq *)oldest->io_Message.mn_Node.ln_Succ;
+             ioreq->io_Message.mn_Node.ln_Succ != NULL && sched_transfer(ioreq,&lba,&count);
+             ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+            if (sched_priority(ioreq) > pri && !sched_blocked(itask,ioreq)) {
+                first = ioreq;
+                pri   = sched_priority(ioreq);
+            }
+        }
+    }
+
+    unit = (struct IDEUnit *)first->io_Unit;
+
+    if (unit->elevator && itask->bypass < SCHED_MAX_BYPASS && sched_transfer(first,&lba,&count)) {
+        for (ioreq = oldest;
+             ioreq->io_Message.mn_Node.ln_Succ != NULL;
+             ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+
+            if (!sched_transfer(ioreq,&lba,&count)) break;
+
+            if ((struct IDEUnit *)ioreq->io_Unit != unit || sched_priority(ioreq) != pri) continue;
+
+            if (sched_blocked(itask,ioreq)) continue;
+
+            if (lba >= unit->headLba) {
+                if (ahead == NULL || lba < aheadLba) {
+                    ahead    = ioreq;
+                    aheadLba = lba;
+                }
+            } else if (wrap == NULL || lba < wrapLba) {
+                wrap    = ioreq;
+                wrapLba = lba;
+            }
+        }
+
+        ioreq = (ahead != NULL) ? ahead : wrap;
+    } else {
+        ioreq = first;
+    }
+
+    if (ioreq == oldest) {
+        itask->bypass = 0;
+    } else {
+        itask->bypass++;
+    }
+
+    Remove((struct Node *)ioreq);
+
+    Enable();
+
+    if (sched_transfer(ioreq,&lba,&count)) {
+        ((struct IDEUnit *)ioreq->io_Unit)->headLba = lba + count;
+    }
+
+    return ioreq;
+}
+
+/**
+ * sched_preempt
+ *
+ * Get a queued transfer with a higher priority than the one in progress, called between the slices of a long transfer
+ * Only transfers ahead of the first barrier are considered, as every queued request arrived after the one in progress.
+ * Transfers that conflict with the one in progress or with an earlier queued one are left alone, see sched_conflict
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param current The transfer in progress
+ * @param pri Priority of the transfer in progress
+ * @returns Pointer to an IOStdReq or NULL if nothing more important is waiting
+*/
+struct IOStdReq *sched_preempt(struct IDETask *itask, struct IOStdReq *current, BYTE pri) {
+    struct IOStdReq *ioreq, *best = NULL;
+    ULONG lba, count;
+
+    Disable();
+
+    sched_pull(itask);
+
+    for (ioreq = (struct IOStdReq *)itask->queue.mlh_Head;
+         ioreq->io_Message.mn_Node.ln_Succ != NULL && sched_transfer(ioreq,&lba,&count);
+         ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+        if (sched_priority(ioreq) > pri && !sched_conflict(current,ioreq) && !sched_blocked(itask,ioreq)) {
+            best = ioreq;
+            pri  = sched_priority(ioreq);
+        }
+    }
+
+    if (best != NULL) Remove((struct Node *)best);
+
+    Enable();
+
+    if (best != NULL && sched_transfer(best,&lba,&count)) {
+        ((struct IDEUnit *)best->io_Unit)->headLba = lba + count;
+        itask->preempted++;
+    }
+
+    return best;
+}
+
+/**
+ * sched_other
+ *
+ * Get the oldest queued transfer for an ATA unit other than the one given, for while an ATAPI unit has released the channel
+ * Only transfers ahead of the first barrier are considered
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param busy Unit with a command in progress
+ * @returns Pointer to an IOStdReq or NULL if there is nothing for the other unit
+*/
+struct IOStdReq *sched_other(struct IDETask *itask, struct IDEUnit *busy) {
+    struct IOStdReq *ioreq, *found = NULL;
+    ULONG lba, count;
+
+    Disable();
+
+    sched_pull(itask);
+
+    for (ioreq = (struct IOStdReq *)itask->queue.mlh_Head;
+         ioreq->io_Message.mn_Node.ln_Succ != NULL && sched_transfer(ioreq,&lba,&count);
+         ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+        if ((struct IDEUnit *)ioreq->io_Unit != busy && !((struct IDEUnit *)ioreq->io_Unit)->atapi) {
+            found = ioreq;
+            Remove((struct Node *)found);
+            break;
+        }
+    }
+
+    Enable();
+
+    if (found != NULL) {
+        ((struct IDEUnit *)found->io_Unit)->headLba = lba + count;
+    }
+
+    return found;
+}
+
+/**
+ * sched_merge
+ *
+ * Take queued requests that continue a transfer so they can be served by the same ATA command
+ *
+ * Requests are taken while one queued ahead of the first barrier starts at the block after the batch so far,
+ * is to the same unit and goes the same way. ETD commands are left alone as they need their change count checked,
+ * as are requests that would be served ahead of an earlier one they conflict with, see sched_blocked.
+ * The batch is kept within unit->maxTransfer blocks.
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param first Request being served
+ * @param batch Array that receives the requests taken
+ * @param max Size of batch
+ * @returns Number of requests taken from the queue
+*/
+ULONG sched_merge(struct IDETask *itask, struct IOStdReq *first, struct IOStdReq **batch, ULONG max) {
+    struct IDEUnit *unit = (struct IDEUnit *)first->io_Unit;
+    struct IOStdReq *ioreq;
+    ULONG lba, count, next, total, taken = 0;
+    bool read = sched_is_read(first->io_Command);
+    bool found;
+
+    if (!sched_transfer(first,&lba,&count)) return 0;
+
+    next  = lba + count;
+    total = count;
+
+    Disable();
+
+    sched_pull(itask);
+
+    do {
+        found = false;
+
+        for (ioreq = (struct IOStdReq *)itask->queue.mlh_Head;
+             ioreq->io_Message.mn_Node.ln_Succ != NULL && taken < max;
+             ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+
+            if (!sched_transfer(ioreq,&lba,&count)) break;
+
+            if ((struct IDEUnit *)ioreq->io_Unit != unit ||
+                 sched_is_read(ioreq->io_Command) != read ||
+                 ioreq->io_Command == ETD_READ   || ioreq->io_Command == NSCMD_ETD_READ64 ||
+                 ioreq->io_Command == ETD_WRITE  || ioreq->io_Command == NSCMD_ETD_WRITE64 ||
+                 ioreq->io_Command == ETD_FORMAT || ioreq->io_Command == NSCMD_ETD_FORMAT64)
+                continue;
+
+            if (lba != next || count == 0 || total + count > unit->maxTransfer || lba + count > unit->logicalSectors)
+                continue;
+
+            if (sched_blocked(itask,ioreq)) continue;
+
+            Remove((struct Node *)ioreq);
+            batch[taken++] = ioreq;
+            next  += count;
+            total += count;
+            found  = true;
+            break;
+        }
+    } while (found && taken < max);
+
+    Enable();
+
+    if (taken > 0) unit->headLba = next;
+
+    return taken;
+}
+
+/**
+ * sched_park
+ *
+ * Hold a transfer for an ATAPI unit that is spinning up rather than failing it,
+ * filesystems would take any error other than a busy unit as the disc having gone.
+ * The request goes back to the queue once the unit's readyPoll time has passed, see sched_unpark
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq Pointer to the IOStdReq to hold
+*/
+void sched_park(struct IDETask *itask, struct IOStdReq *ioreq) {
+    Disable();
+    AddTail((struct List *)&itask->parked,(struct Node *)ioreq);
+    Enable();
+}
+
+/**
+ * sched_unpark
+ *
+ * Put parked transfers back at the head of the queue, in the order they were parked,
+ * once their unit is no longer becoming ready or it is time to try it again
+ *
+ * @param itask Pointer to an IDETask struct
+*/
+void sched_unpark(struct IDETask *itask) {
+    struct IOStdReq *ioreq, *prev;
+    struct IDEUnit *unit;
+    ULONG now;
+
+    if (itask->parked.mlh_Head->mln_Succ == NULL) return;
+
+    now = get_time_ms(itask->tr);
+
+    Disable();
+
+    for (ioreq = (struct IOStdReq *)itask->parked.mlh_TailPred;
+         ioreq->io_Message.mn_Node.ln_Pred != NULL;
+         ioreq = prev) {
+        prev = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Pred;
+        unit = (struct IDEUnit *)ioreq->io_Unit;
+
+        if (!unit->becomingReady || (LONG)(now - unit->readyPoll) >= 0) {
+            Remove((struct Node *)ioreq);
+            AddHead((struct List *)&itask->queue,(struct Node *)ioreq);
+        }
+    }
+
+    Enable();
+}
+
+/**
+ * sched_parked
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param unit Pointer to an IDEUnit struct
+ * @returns true if a transfer for the unit is parked
+*/
+bool sched_parked(struct IDETask *itask, struct IDEUnit *unit) {
+    struct IOStdReq *ioreq;
+    bool found = false;
+
+    Disable();
+
+    for (ioreq = (struct IOStdReq *)itask->parked.mlh_Head;
+         ioreq->io_Message.mn_Node.ln_Succ != NULL;
+         ioreq = (struct IOStdReq *)ioreq->io_Message.mn_Node.ln_Succ) {
+        if ((struct IDEUnit *)ioreq->io_Unit == unit) {
+            found = true;
+            break;
+        }
+    }
+
+    Enable();
+
+    return found;
+}
+
+/**
+ * sched_abort
+ *
+ * Remove a request from the queue or the parked transfers of an IDE task if it hasn't been started
+ * Must be called inside Disable()
+ *
+ * @param itask Pointer to an IDETask struct
+ * @param ioreq Pointer to the IORequest to abort
+ * @returns true if the request was found and removed
+*/
+bool sched_abort(struct IDETask *itask, struct IORequest *ioreq) {
+    struct IORequest *io;
+
+    for (io = (struct IORequest *)itask->queue.mlh_Head;
+         io->io_Message.mn_Node.ln_Succ != NULL;
+         io = (struct IORequest *)io->io_Message.mn_Node.ln_Succ)
+    {
+        if (io == ioreq) {
+            Remove(&io->io_Message.mn_Node);
+            sched_done((struct IOStdReq *)io);
+            return true;
+        }
+    }
+
+    for (io = (struct IORequest *)itask->parked.mlh_Head;
+         io->io_Message.mn_Node.ln_Succ != NULL;
+         io = (struct IORequest *)io->io_Message.mn_Node.ln_Succ)
+    {
+        if (io == ioreq) {
+            Remove(&io->io_Message.mn_Node);
+            sched_done((struct IOStdReq *)io);
+            return true;
+        }
+    }
+
+    return false;
+}
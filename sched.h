@@ -0,0 +1,37 @@
+// SPDX-License-Identifier: GPL-2.0-only
+/* This file is part of lide.device
+ * Copyright (C) 2023 Matthew Harlum <matt@harlum.net>
+ */
+#ifndef _SCHED_H
+#define _SCHED_H
+
+#include <exec/io.h>
+#include <exec/types.h>
+#include <stdbool.h>
+#include "device.h"
+
+#ifndef ELEVATOR
+#define ELEVATOR 1 // Serve transfers to rotating drives in C-SCAN order, 0 serves everything in arrival order
+#endif
+
+#define SCHED_MAX_BYPASS 8 // Number of times the oldest request can be passed over before it is served
+#define SCHED_MAX_MERGE  8 // Most requests served by one merged transfer
+
+#ifndef SCHED_SLICE_BLOCKS
+#define SCHED_SLICE_BLOCKS 64 // Long transfers are split into slices of this many blocks so higher priority requests can get in between
+#endif
+
+void sched_init(struct IDETask *itask);
+bool sched_transfer(struct IOStdReq *ioreq, ULONG *lba, ULONG *count);
+BYTE sched_priority(struct IOStdReq *ioreq);
+struct IOStdReq *sched_next(struct IDETask *itask);
+struct IOStdReq *sched_preempt(struct IDETask *itask, struct IOStdReq *current, BYTE pri);
+struct IOStdReq *sched_other(struct IDETask *itask, struct IDEUnit *busy);
+ULONG sched_merge(struct IDETask *itask, struct IOStdReq *first, struct IOStdReq **batch, ULONG max);
+void sched_park(struct IDETask *itask, struct IOStdReq *ioreq);
+void sched_unpark(struct IDETask *itask);
+bool sched_parked(struct IDETask *itask, struct IDEUnit *unit);
+void sched_done(struct IOStdReq *ioreq);
+bool sched_abort(struct IDETask *itask, struct IORequest *ioreq);
+
+#endif
@@ -7,6 +7,7 @@
 
 #include <devices/timer.h>
 #include <exec/types.h>
+#include <inline/timer.h>
 #include <proto/exec.h>
 
 static inline void wait(struct timerequest *tr, ULONG seconds) {
@@ -23,4 +24,69 @@ static inline void wait_us(struct timerequest *tr, ULONG micros) {
     DoIO((struct IORequest *)tr);
 }
 
+static inline void wait_ms(struct timerequest *tr, ULONG millis) {
+    tr->tr_node.io_Command = TR_ADDREQUEST;
+    tr->tr_time.tv_sec     = millis / 1000;
+    tr->tr_time.tv_micro   = (millis % 1000) * 1000;
+    DoIO((struct IORequest *)tr);
+}
+
+/**
+ * get_time_ms
+ * 
+ * Get the system time in milliseconds, for timestamps that are only compared with each other
+ * Uses TR_GETSYSTIME so this also works on Kickstart 1.3
+ * 
+ * @param tr An open timerequest
+ * @returns milliseconds, wraps around every 49 days
+*/
+static inline ULONG get_time_ms(struct timerequest *tr) {
+    tr->tr_node.io_Command = TR_GETSYSTIME;
+    DoIO((struct IORequest *)tr);
+    return (tr->tr_time.tv_sec * 1000) + (tr->tr_time.tv_micro / 1000);
+}
+
+/**
+ * read_eclock
+ * 
+ * Read the low longword of the EClock, needs timer.device V36+
+ * 
+ * @param tr An open timerequest
+ * @returns EClock ticks
+*/
+static inline ULONG read_eclock(struct timerequest *tr) {
+    struct Device *TimerBase = tr->tr_node.io_Device;
+    struct EClockVal ev;
+    ReadEClock(&ev);
+    return ev.ev_lo;
+}
+
+/**
+ * eclock_to_us
+ * 
+ * Convert a count of EClock ticks to microseconds without overflowing 32 bits
+ * 
+ * @param ticks EClock ticks
+ * @param per_ms EClock ticks per millisecond
+ * @returns microseconds
+*/
+static inline ULONG eclock_to_us(ULONG ticks, ULONG per_ms) {
+    return ((ticks / per_ms) * 1000) + (((ticks % per_ms) * 1000) / per_ms);
+}
+
+/**
+ * wait_eclock_us
+ * 
+ * Busy-wait on the EClock, for delays too short to be worth a round trip through timer.device
+ * 
+ * @param tr An open timerequest
+ * @param micros Microseconds to wait, less than 1000
+ * @param per_ms EClock ticks per millisecond
+*/
+static inline void wait_eclock_us(struct timerequest *tr, ULONG micros, ULONG per_ms) {
+    ULONG ticks = ((micros * per_ms) / 1000) + 1;
+    ULONG start = read_eclock(tr);
+    while ((read_eclock(tr) - start) < ticks);
+}
+
 #endif
\ No newline at end of file